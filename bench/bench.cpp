@@ -0,0 +1,117 @@
+/* Throughput of the main screen paths, printed as a table. Needs nothing but the header:
+ *
+ *     c++ -std=c++20 -O2 -I. bench/bench.cpp -o straw-bench -pthread && ./straw-bench
+ *
+ * Frames go to a null_sink, so flush and redraw times are encoding only; bytes per frame
+ * and the flush_stats counters show what would have reached the terminal. */
+#include "straw.hpp"
+
+#include <cstdio>
+#include <string>
+
+using clock_type = std::chrono::steady_clock;
+
+/* Runs op until at least budget has passed and returns the time per call. */
+template<typename F>
+static double nsper(F &&op, std::chrono::milliseconds budget = std::chrono::milliseconds(200)) {
+    std::size_t n = 0, batch = 1;
+    clock_type::duration spent{};
+    while(spent < budget) {
+        auto start = clock_type::now();
+        for(std::size_t i = 0; i < batch; i++) op();
+        spent += clock_type::now() - start;
+        n += batch;
+        batch *= 2;
+    }
+    return std::chrono::duration<double, std::nano>(spent).count() / n;
+}
+
+template<straw::char_type chartype>
+static std::basic_string<chartype> widen(std::string_view s) { return std::basic_string<chartype>(s.begin(), s.end()); }
+
+template<straw::char_type chartype>
+static const char *name() { return sizeof(chartype) == 1 ? "char" : "char32_t"; }
+
+static void row(const char *type, unsigned w, unsigned h, const char *what, double ns, const char *unit,
+        double bytes = -1, const straw::flush_stats *stats = nullptr) {
+    std::printf("%-9s %4ux%-4u %-22s %12.2f %-6s", type, w, h, what, ns, unit);
+    if(bytes >= 0) std::printf(" %10.0f B/frame", bytes);
+    if(stats) std::printf(" %8zu diffed %8zu emitted %8zu esc", stats->cellsdiffed, stats->cellsemitted, stats->escapebytes);
+    std::printf("\n");
+}
+
+template<straw::char_type chartype>
+static void text(unsigned w, unsigned h) {
+    auto sink = std::make_shared<straw::null_sink>();
+    straw::screen<chartype> s(sink, 0, 0, w, h, ' ', straw::color{0}, straw::color{255});
+    /* The screen is the whole (null) terminal, so scroll + flush can use DECSTBM and SU. */
+    s.sethardwarescroll(true);
+    auto home = [&] { if(s.getcursory() + 1 >= h) s.setcursorxy(0, 0); };
+
+    row(name<chartype>(), w, h, "putc", nsper([&] { home(); s.putc('x'); }), "ns/op");
+
+    auto words = widen<chartype>("hello, world ");
+    row(name<chartype>(), w, h, "puts 13 glyphs", nsper([&] { home(); s.puts(words); }), "ns/op");
+
+    row(name<chartype>(), w, h, "operator<< int", nsper([&] { home(); s << 1234567; }), "ns/op");
+    row(name<chartype>(), w, h, "operator<< double", nsper([&] { home(); s << 3.25; }), "ns/op");
+
+    row(name<chartype>(), w, h, "scroll", nsper([&] { s.scroll(); }), "ns/op");
+    s.flush();
+    row(name<chartype>(), w, h, "scroll + flush", nsper([&] {
+        s.setcursorxy(0, h - 1);
+        s.puts(words);
+        s.scroll();
+        s.flush();
+    }), "ns/op");
+}
+
+/* Changes percent of the cells, spread over the screen, before every flush; the time
+ * includes those edits. Stats are only turned on for one last frame, as timing the diff
+ * costs a clock read per changed run. */
+template<straw::char_type chartype>
+static void frames(unsigned w, unsigned h) {
+    auto sink = std::make_shared<straw::null_sink>();
+    straw::screen<chartype> s(sink, 0, 0, w, h, ' ', straw::color{0}, straw::color{255});
+    for(unsigned percent : {0u, 1u, 10u, 100u}) {
+        std::size_t cells = std::size_t{w} * h, changed = cells * percent / 100, frame = 0;
+        std::size_t startbytes = sink->bytes(), flushes = 0;
+        auto edit = [&] {
+            chartype c = 'a' + frame++ % 26;
+            for(std::size_t i = 0; i < changed; i++) {
+                std::size_t at = i * cells / changed;
+                s.setc(at % w, at / w, c);
+            }
+            s.flush();
+            flushes++;
+        };
+        double ns = nsper(edit);
+        double bytes = double(sink->bytes() - startbytes) / flushes;
+        s.setstats(true);
+        edit();
+        s.setstats(false);
+        char what[32];
+        std::snprintf(what, sizeof what, "flush %u%% changed", percent);
+        row(name<chartype>(), w, h, what, ns / 1000, "us", bytes, &s.getstats());
+    }
+
+    std::size_t startbytes = sink->bytes(), redraws = 0;
+    double ns = nsper([&] { s.redraw(); redraws++; });
+    double bytes = double(sink->bytes() - startbytes) / redraws;
+    s.setstats(true);
+    s.redraw();
+    row(name<chartype>(), w, h, "redraw", ns / 1000, "us", bytes, &s.getstats());
+}
+
+template<straw::char_type chartype>
+static void suite() {
+    for(auto [w, h] : {std::pair{80u, 24u}, std::pair{200u, 60u}, std::pair{400u, 120u}}) {
+        text<chartype>(w, h);
+        frames<chartype>(w, h);
+    }
+}
+
+int main() {
+    suite<char>();
+    suite<char32_t>();
+}
@@ -7,10 +7,50 @@
 #include <vector>
 #include <span>
 #include <string>
+#include <string_view>
 #include <concepts>
 #include <cassert>
 #include <iostream>
 #include <algorithm>
+#include <limits>
+#include <utility>
+#include <memory>
+#include <unordered_map>
+#include <array>
+#include <charconv>
+#include <bit>
+#include <type_traits>
+#include <cstdio>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <functional>
+#include <deque>
+#include <cstring>
+
+#if __has_include(<unistd.h>)
+#include <unistd.h>
+#include <poll.h>
+#define STRAW_POSIX 1
+#endif
+
+/* tty_mode and event_loop need termios and signals, whose macros (ECHO, B0 and so on) would
+ * otherwise reach every file including this header; define STRAW_TTY to get them. */
+#if defined(STRAW_POSIX) && defined(STRAW_TTY)
+#include <fcntl.h>
+#include <signal.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+#endif
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 namespace straw
 {
@@ -20,87 +60,1073 @@ struct color {
     constexpr color(std::uint8_t R, std::uint8_t G, std::uint8_t B) : r(R), g(G), b(B) {}
     constexpr color(std::uint8_t A) : r(A), g(A), b(A) {}
 
-    constexpr uint32_t single() { return (uint32_t)r << 16 | (uint32_t)g << 8 | (uint32_t)b; }
+    constexpr uint32_t single() const { return (uint32_t)r << 16 | (uint32_t)g << 8 | (uint32_t)b; }
 
     constexpr bool operator==(const color &o) const = default;
 };
 
 struct attribs {
     color bg{0, 0, 0}, fg{255, 255, 255};
-    bool bold, underline;
+    bool bold{}, underline{};
     constexpr attribs() = default;
     constexpr attribs(color Fg) : fg(Fg) {}
     constexpr attribs(color Bg, color Fg) : bg(Bg), fg(Fg) {}
     constexpr attribs(color Bg, color Fg, bool B, bool U) : bg(Bg), fg(Fg), bold(B), underline(U) {}
 
+    constexpr std::uint64_t packed() const {
+        return (std::uint64_t)fg.single() << 26 | (std::uint64_t)bg.single() << 2 | bold << 1 | underline;
+    }
+
     constexpr bool operator==(const attribs &o) const = default;
 };
 
 template<typename T>
 concept char_type = std::integral<T>;
 
+template<typename T>
+constexpr bool is_character = std::is_same_v<T, char> || std::is_same_v<T, signed char> ||
+    std::is_same_v<T, unsigned char> || std::is_same_v<T, wchar_t> ||
+    std::is_same_v<T, char8_t> || std::is_same_v<T, char16_t> || std::is_same_v<T, char32_t>;
+
+template<std::size_t N>
+struct padding {
+    std::uint8_t bytes[N]{};
+    constexpr bool operator==(const padding &o) const = default;
+};
+template<>
+struct padding<0> {
+    constexpr bool operator==(const padding &o) const = default;
+};
+
+/* A glyph and an index into its screen's style table. The explicit padding keeps every
+ * byte defined, so rows can be compared as raw memory. */
 template<char_type chartype>
 struct cell {
+    static constexpr std::size_t padsize = sizeof(chartype) == 1 ? 1 : sizeof(chartype) - 2;
+
     chartype chr{};
-    attribs attr{};
+    [[no_unique_address]] padding<padsize> pad{};
+    std::uint16_t style{};
 
     constexpr cell() = default;
     constexpr cell(chartype Chr) : chr(Chr) {}
-    constexpr cell(chartype Chr, color Fg) : chr(Chr), attr(Fg) {}
-    constexpr cell(chartype Chr, color Bg, color Fg) : chr(Chr), attr(Bg, Fg) {}
-    constexpr cell(chartype Chr, color Bg, color Fg, bool B, bool U) : chr(Chr), attr(Bg, Fg, B, U) {}
-    constexpr cell(chartype Chr, attribs Attr) : chr(Chr), attr(Attr) {}
+    constexpr cell(chartype Chr, std::uint16_t Style) : chr(Chr), style(Style) {}
 
     constexpr bool operator==(const cell &o) const = default;
 };
 
-const std::string ANSI_ESCAPE = "\E[";
-static void ANSI_MOVE(unsigned x, unsigned y) { std::cout << ANSI_ESCAPE << y+1 << ';' << x+1 << 'H' << std::flush; }
-static void ANSI_COLOR_FG(color c) { std::cout << ANSI_ESCAPE << "38;2;" << c.r << ';' << c.g << ';' << c.b << 'm' << std::flush; }
-static void ANSI_COLOR_BG(color c) { std::cout << ANSI_ESCAPE << "48;2;" << c.r << ';' << c.g << ';' << c.b << 'm' << std::flush; }
+/* Whether equality of T is equality of its bytes. */
+template<typename T>
+constexpr bool bytewise = std::has_unique_object_representations_v<T>;
+template<char_type chartype>
+constexpr bool bytewise<cell<chartype>> =
+    sizeof(cell<chartype>) == sizeof(chartype) + cell<chartype>::padsize + sizeof(std::uint16_t);
+
+/* Decimal spellings of 0-255, so escape parameters never go through iostreams or allocate. */
+struct decimal {
+    char s[3];
+    std::uint8_t len;
+};
+constexpr std::array<decimal, 256> DECIMALS = [] {
+    std::array<decimal, 256> t{};
+    for(unsigned i = 0; i < 256; i++) {
+        decimal &d = t[i];
+        if(i >= 100) d.s[d.len++] = '0' + i / 100;
+        if(i >= 10) d.s[d.len++] = '0' + i / 10 % 10;
+        d.s[d.len++] = '0' + i % 10;
+    }
+    return t;
+}();
+
+static void ANSI_UINT(std::string &out, unsigned v) {
+    if(v < 256) {
+        out.append(DECIMALS[v].s, DECIMALS[v].len);
+        return;
+    }
+    char buf[10];
+    char *p = buf + sizeof(buf);
+    do { *--p = '0' + v % 10; v /= 10; } while(v);
+    out.append(p, buf + sizeof(buf));
+}
+
+/* Offset of the first differing byte of a and b, or n. */
+static std::size_t firstdiffbyte(const unsigned char *a, const unsigned char *b, std::size_t n) {
+    std::size_t i = 0;
+#if defined(__AVX2__)
+    for(; i + 32 <= n; i += 32) {
+        __m256i eq = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(a + i)), _mm256_loadu_si256((const __m256i *)(b + i)));
+        std::uint32_t m = ~(std::uint32_t)_mm256_movemask_epi8(eq);
+        if(m) return i + std::countr_zero(m);
+    }
+#endif
+#if defined(__SSE2__)
+    for(; i + 16 <= n; i += 16) {
+        __m128i eq = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(a + i)), _mm_loadu_si128((const __m128i *)(b + i)));
+        std::uint32_t m = ~(std::uint32_t)_mm_movemask_epi8(eq) & 0xFFFF;
+        if(m) return i + std::countr_zero(m);
+    }
+#elif defined(__ARM_NEON)
+    for(; i + 16 <= n; i += 16) {
+        uint8x16_t eq = vceqq_u8(vld1q_u8(a + i), vld1q_u8(b + i));
+        std::uint64_t m = ~vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+        if(m) return i + std::countr_zero(m) / 4;
+    }
+#endif
+    for(; i < n; i++) if(a[i] != b[i]) return i;
+    return n;
+}
+
+/* Index of the first cell that differs between a and b, or n. Cells without padding
+ * are compared as raw bytes 16 or 32 at a time. */
+template<typename T>
+static std::size_t firstdiff(const T *a, const T *b, std::size_t n) {
+    if constexpr(bytewise<T>) {
+        return firstdiffbyte(reinterpret_cast<const unsigned char *>(a),
+                reinterpret_cast<const unsigned char *>(b), n * sizeof(T)) / sizeof(T);
+    } else {
+        return std::mismatch(a, a + n, b).first - a;
+    }
+}
+
+constexpr std::string_view ANSI_ESCAPE = "\E[";
+static void ANSI_MOVE(std::string &out, unsigned x, unsigned y) {
+    out += ANSI_ESCAPE; ANSI_UINT(out, y+1); out += ';'; ANSI_UINT(out, x+1); out += 'H';
+}
+static void ANSI_FORWARD(std::string &out, unsigned n) {
+    out += ANSI_ESCAPE; if(n > 1) ANSI_UINT(out, n); out += 'C';
+}
+
+/* Sequences without parameters, spelled out once. */
+enum class ansi_fixed { reset, regionreset, hidecursor, showcursor, syncbegin, syncend, mouseon, mouseoff };
+constexpr std::array<std::string_view, 8> ANSI_FIXED{
+    "\E[0m", "\E[r", "\E[?25l", "\E[?25h", "\E[?2026h", "\E[?2026l",
+    "\E[?1002h\E[?1006h", "\E[?1006l\E[?1002l"
+};
+constexpr std::string_view ANSI_FIXED_SEQ(ansi_fixed f) { return ANSI_FIXED[static_cast<std::size_t>(f)]; }
+
+static void ANSI_SCROLL_UP(std::string &out, unsigned top, unsigned bottom, unsigned n) {
+    out += ANSI_ESCAPE; ANSI_UINT(out, top+1); out += ';'; ANSI_UINT(out, bottom); out += 'r';
+    out += ANSI_ESCAPE; if(n > 1) ANSI_UINT(out, n); out += 'S';
+    out += ANSI_FIXED_SEQ(ansi_fixed::regionreset);
+}
+/* mono sends no colors at all, only bold and underline. */
+enum class color_depth { truecolor, xterm256, ansi16, mono };
+
+/* RGB on the xterm palettes, each channel cut to 5 bits: 32k entries per table. */
+static std::size_t PALETTE_KEY(color c) { return (c.r >> 3) << 10 | (c.g >> 3) << 5 | (c.b >> 3); }
+
+static std::uint8_t PALETTE_NEAREST(color c, std::span<const color> palette, unsigned first) {
+    unsigned best = first, bestdist = ~0u;
+    for(unsigned i = first; i < palette.size(); i++) {
+        int dr = c.r - palette[i].r, dg = c.g - palette[i].g, db = c.b - palette[i].b;
+        unsigned dist = 2 * dr * dr + 4 * dg * dg + 3 * db * db;
+        if(dist < bestdist) { bestdist = dist; best = i; }
+    }
+    return best;
+}
+
+static const std::array<std::uint8_t, 32768> &PALETTE_TABLE(color_depth depth) {
+    static const auto build = [](std::span<const color> palette, unsigned first) {
+        std::array<std::uint8_t, 32768> t{};
+        for(unsigned k = 0; k < t.size(); k++) {
+            auto up = [](unsigned v) { return std::uint8_t(v << 3 | v >> 2); };
+            t[k] = PALETTE_NEAREST(color{up(k >> 10), up(k >> 5 & 31), up(k & 31)}, palette, first);
+        }
+        return t;
+    };
+    static const std::array<color, 16> ansi{{
+        {0, 0, 0}, {205, 0, 0}, {0, 205, 0}, {205, 205, 0}, {0, 0, 238}, {205, 0, 205}, {0, 205, 205}, {229, 229, 229},
+        {127, 127, 127}, {255, 0, 0}, {0, 255, 0}, {255, 255, 0}, {92, 92, 255}, {255, 0, 255}, {0, 255, 255}, {255, 255, 255}
+    }};
+    if(depth == color_depth::ansi16) {
+        static const auto t16 = build(ansi, 0);
+        return t16;
+    }
+    /* The 16 system colors are user-configurable, so only the cube and gray ramp are matched. */
+    static const auto t256 = [&] {
+        std::vector<color> xterm(ansi.begin(), ansi.end());
+        static constexpr std::uint8_t levels[6] = {0, 95, 135, 175, 215, 255};
+        for(unsigned i = 0; i < 216; i++) xterm.push_back(color{levels[i / 36], levels[i / 6 % 6], levels[i % 6]});
+        for(unsigned i = 0; i < 24; i++) xterm.push_back(color(std::uint8_t(8 + 10 * i)));
+        return build(xterm, 16);
+    }();
+    return t256;
+}
+
+static std::uint8_t QUANTIZE(color c, color_depth depth) { return PALETTE_TABLE(depth)[PALETTE_KEY(c)]; }
+
+template<color_depth depth>
+static void ANSI_SGR_COLOR(std::string &out, char sel, color c) {
+    if constexpr(depth == color_depth::truecolor) {
+        out += sel; out += "8;2;";
+        ANSI_UINT(out, c.r); out += ';'; ANSI_UINT(out, c.g); out += ';'; ANSI_UINT(out, c.b);
+    } else if constexpr(depth == color_depth::xterm256) {
+        out += sel; out += "8;5;"; ANSI_UINT(out, QUANTIZE(c, depth));
+    } else if constexpr(depth == color_depth::ansi16) {
+        unsigned i = QUANTIZE(c, depth);
+        ANSI_UINT(out, (sel == '3' ? 30 : 40) + (i < 8 ? i : 60 + i - 8));
+    }
+}
+
+/* What a terminal supports. A fixed set lets screen<chartype, caps> compile its flush for
+ * exactly that terminal: the color depth, whether glyphs outside ASCII may be sent as UTF-8
+ * (otherwise they show as '?', one per column), and whether scroll regions may be used. */
+template<color_depth Depth, bool Utf8 = true, bool ScrollRegion = true>
+struct capabilities {
+    static constexpr bool fixed = true;
+    static constexpr color_depth depth = Depth;
+    static constexpr bool utf8 = Utf8;
+    static constexpr bool scrollregion = ScrollRegion;
+};
+/* The default: the color depth is the writer's, set at run time by setcolordepth(). */
+struct dynamic_capabilities {
+    static constexpr bool fixed = false;
+    static constexpr color_depth depth = color_depth::truecolor;
+    static constexpr bool utf8 = true;
+    static constexpr bool scrollregion = true;
+};
+
+constexpr unsigned digits(unsigned n) { unsigned d = 1; while(n >= 10) { n /= 10; d++; } return d; }
+
+/* East Asian Wide and Fullwidth ranges, including the emoji presentation blocks. */
+constexpr std::array<std::pair<char32_t, char32_t>, 38> WIDE_RANGES{{
+    {0x1100, 0x115F}, {0x231A, 0x231B}, {0x2329, 0x232A}, {0x23E9, 0x23EC}, {0x23F0, 0x23F0},
+    {0x23F3, 0x23F3}, {0x25FD, 0x25FE}, {0x2614, 0x2615}, {0x2648, 0x2653}, {0x267F, 0x267F},
+    {0x2693, 0x2693}, {0x26A1, 0x26A1}, {0x26AA, 0x26AB}, {0x26BD, 0x26BE}, {0x26C4, 0x26C5},
+    {0x26CE, 0x26CE}, {0x26D4, 0x26D4}, {0x26EA, 0x26EA}, {0x26F2, 0x26F5}, {0x26FA, 0x26FD},
+    {0x2705, 0x2705}, {0x270A, 0x270B}, {0x2728, 0x2728}, {0x274C, 0x274C}, {0x2E80, 0x303E},
+    {0x3041, 0x33FF}, {0x3400, 0x4DBF}, {0x4E00, 0x9FFF}, {0xA000, 0xA4CF}, {0xA960, 0xA97F},
+    {0xAC00, 0xD7A3}, {0xF900, 0xFAFF}, {0xFE10, 0xFE19}, {0xFE30, 0xFE6F}, {0xFF00, 0xFF60},
+    {0xFFE0, 0xFFE6}, {0x1F300, 0x1FAFF}, {0x20000, 0x3FFFD}
+}};
+
+/* Terminal columns taken by a code point: 2 for wide glyphs, otherwise 1. */
+constexpr unsigned glyphwidth(char32_t c) {
+    if(c < WIDE_RANGES.front().first) return 1;
+    auto it = std::upper_bound(WIDE_RANGES.begin(), WIDE_RANGES.end(), c,
+            [](char32_t v, const std::pair<char32_t, char32_t> &r) { return v < r.first; });
+    return it != WIDE_RANGES.begin() && c <= (it - 1)->second ? 2 : 1;
+}
+
+/* Byte-sized glyphs are passed through; wider ones are code points sent as UTF-8.
+ * Surrogates and out-of-range values become U+FFFD. */
+template<char_type chartype>
+constexpr char32_t codepoint(chartype c) {
+    char32_t u = static_cast<char32_t>(c);
+    return (u >= 0xD800 && u <= 0xDFFF) || u > 0x10FFFF ? 0xFFFD : u;
+}
+
+template<char_type chartype>
+constexpr unsigned glyphwidth(chartype c) {
+    if constexpr(sizeof(chartype) == 1) return 1;
+    else return glyphwidth(codepoint(c));
+}
+
+template<char_type chartype>
+constexpr unsigned glyphbytes(chartype c) {
+    if constexpr(sizeof(chartype) == 1) return 1;
+    else {
+        char32_t u = codepoint(c);
+        return u < 0x80 ? 1 : u < 0x800 ? 2 : u < 0x10000 ? 3 : 4;
+    }
+}
+
+static void UTF8_ENCODE(std::string &out, char32_t u) {
+    if(u < 0x80) {
+        out += static_cast<char>(u);
+    } else if(u < 0x800) {
+        char b[2] = {char(0xC0 | u >> 6), char(0x80 | (u & 0x3F))};
+        out.append(b, 2);
+    } else if(u < 0x10000) {
+        char b[3] = {char(0xE0 | u >> 12), char(0x80 | (u >> 6 & 0x3F)), char(0x80 | (u & 0x3F))};
+        out.append(b, 3);
+    } else {
+        char b[4] = {char(0xF0 | u >> 18), char(0x80 | (u >> 12 & 0x3F)), char(0x80 | (u >> 6 & 0x3F)), char(0x80 | (u & 0x3F))};
+        out.append(b, 4);
+    }
+}
+
+/* Destination for finished frames. Each call carries one whole frame. */
+class sink {
+public:
+    virtual ~sink() = default;
+    virtual void write(std::string_view frame) = 0;
+};
+
+class ostream_sink : public sink {
+public:
+    explicit ostream_sink(std::ostream &Os) : m_os(Os) {}
+    void write(std::string_view frame) override {
+        m_os.write(frame.data(), frame.size());
+        m_os.flush();
+    }
+private:
+    std::ostream &m_os;
+};
+
+class file_sink : public sink {
+public:
+    explicit file_sink(std::FILE *File) : m_file(File) {}
+    void write(std::string_view frame) override {
+        std::fwrite(frame.data(), 1, frame.size(), m_file);
+        std::fflush(m_file);
+    }
+private:
+    std::FILE *m_file;
+};
+
+/* Keeps every frame, for tests and for forwarding elsewhere. */
+class memory_sink : public sink {
+public:
+    void write(std::string_view frame) override { m_data.append(frame); m_frames++; }
+    std::string_view data() const { return m_data; }
+    std::size_t frames() const { return m_frames; }
+    void clear() { m_data.clear(); m_frames = 0; }
+private:
+    std::string m_data;
+    std::size_t m_frames{};
+};
+
+class null_sink : public sink {
+public:
+    void write(std::string_view frame) override { m_bytes += frame.size(); }
+    std::size_t bytes() const { return m_bytes; }
+private:
+    std::size_t m_bytes{};
+};
+
+#ifdef STRAW_POSIX
+/* Writes straight to a tty, pty or socket with write(2), bypassing stdio. A frame is
+ * finished even on a non-blocking descriptor; a hard error stops output and is kept in error(). */
+class fd_sink : public sink {
+public:
+    explicit fd_sink(int Fd) : m_fd(Fd) {}
+    void write(std::string_view frame) override {
+        while(!frame.empty() && m_error == 0) {
+            ssize_t n = ::write(m_fd, frame.data(), frame.size());
+            if(n >= 0) {
+                frame.remove_prefix(n);
+            } else if(errno == EAGAIN || errno == EWOULDBLOCK) {
+                pollfd p{m_fd, POLLOUT, 0};
+                ::poll(&p, 1, -1);
+            } else if(errno != EINTR) {
+                m_error = errno;
+            }
+        }
+    }
+    int error() const { return m_error; }
+private:
+    int m_fd;
+    int m_error{};
+};
+#endif
+
+/* What one flush cost. The times are only measured while a screen's stats are enabled;
+ * escape bytes are everything sent that is not a glyph. write is zero when the frame was
+ * encoded into a writer that the screen does not commit itself. */
+struct flush_stats {
+    std::size_t cellsdiffed{}, cellsemitted{};
+    std::size_t escapebytes{}, glyphbytes{};
+    std::size_t moves{}, sgrchanges{}, writes{};
+    std::chrono::nanoseconds diff{}, encode{}, write{};
+};
+
+/* Collects every escape and glyph of a frame so it reaches the terminal in one write.
+ * Also tracks where the terminal cursor really is and which attributes are in effect,
+ * so moves and SGR changes are only sent when needed. */
+class writer {
+public:
+    static constexpr unsigned unknown = ~0u;
+
+    writer() : m_sink(std::make_shared<ostream_sink>(std::cout)) {}
+    explicit writer(std::shared_ptr<sink> Sink) : m_sink(std::move(Sink)) {}
+
+    /* Whatever the terminal behind the new sink shows is unknown. */
+    void setsink(std::shared_ptr<sink> Sink) { m_sink = std::move(Sink); invalidate(); }
+    sink &getsink() { return *m_sink; }
+
+    void put(char c) { m_buf.push_back(c); }
+    void put(std::string_view s) { m_buf.append(s); }
+
+    /* Bytes needed to get the cursor to (x, y) with the cheapest encoding. */
+    std::size_t movecost(unsigned x, unsigned y) const {
+        if(y == m_cy && x == m_cx) return 0;
+        std::size_t cup = 4 + digits(y+1) + digits(x+1);
+        if(y != m_cy) return cup;
+        if(x == 0) return 1;
+        if(m_cx != unknown && x > m_cx) return std::min(cup, std::size_t{x - m_cx > 1 ? 3 + digits(x - m_cx) : 3});
+        return std::min(cup, std::size_t{1 + (x > 1 ? 3 + digits(x) : 3)});
+    }
+
+    void move(unsigned x, unsigned y) {
+        if(y == m_cy && x == m_cx) return;
+        std::size_t cup = 4 + digits(y+1) + digits(x+1);
+        if(y == m_cy && movecost(x, y) < cup) {
+            if(m_cx == unknown || x < m_cx) { m_buf.push_back('\r'); m_cx = 0; }
+            if(x > m_cx) ANSI_FORWARD(m_buf, x - m_cx);
+        } else ANSI_MOVE(m_buf, x, y);
+        m_cx = x; m_cy = y;
+        m_moves++;
+    }
+
+    /* Switch the terminal to a, sending only what differs as a single SGR sequence. With
+     * fixed capabilities the encoding is chosen at compile time, otherwise once per call. */
+    template<typename caps = dynamic_capabilities>
+    void attr(const attribs &a) {
+        if(m_attrKnown && a == m_attr) return;
+        if constexpr(caps::fixed) attrat<caps::depth>(a);
+        else switch(m_depth) {
+            case color_depth::truecolor: attrat<color_depth::truecolor>(a); break;
+            case color_depth::xterm256: attrat<color_depth::xterm256>(a); break;
+            case color_depth::ansi16: attrat<color_depth::ansi16>(a); break;
+            case color_depth::mono: attrat<color_depth::mono>(a); break;
+        }
+    }
+    const attribs *currentattr() const { return m_attrKnown ? &m_attr : nullptr; }
+
+    /* Colors are quantized through PALETTE_TABLE below truecolor. */
+    void setcolordepth(color_depth depth) { m_depth = depth; m_attrKnown = false; }
+    color_depth getcolordepth() const { return m_depth; }
+
+    void put(ansi_fixed f) { m_buf += ANSI_FIXED_SEQ(f); }
+
+    /* Wrap every frame in a synchronized update (DEC mode 2026), so terminals that support it
+     * show the frame at once, and/or hide the cursor while the frame is drawn. */
+    void setframing(bool sync, bool hidecursor) { m_sync = sync; m_hideCursor = hidecursor; }
+    /* Where framing leaves the cursor after each frame; unknown leaves it after the last glyph. */
+    void setcursor(unsigned x, unsigned y) { m_restX = x; m_restY = y; }
+
+    template<typename caps = dynamic_capabilities, char_type chartype>
+    void glyph(chartype c) {
+        std::size_t start = m_buf.size();
+        if constexpr(sizeof(chartype) == 1) {
+            m_buf.push_back(static_cast<char>(c));
+            if(m_cx != unknown) m_cx++;
+        } else if constexpr(!caps::utf8) {
+            char32_t u = codepoint(c);
+            unsigned w = glyphwidth(u);
+            if(u < 0x80) m_buf.push_back(static_cast<char>(u));
+            else m_buf.append(w, '?');
+            if(m_cx != unknown) m_cx += w;
+        } else {
+            char32_t u = codepoint(c);
+            UTF8_ENCODE(m_buf, u);
+            if(m_cx != unknown) m_cx += glyphwidth(u);
+        }
+        m_glyphBytes += m_buf.size() - start;
+    }
+
+    /* Scroll terminal rows [top, bottom) up by n inside a temporary scroll region. */
+    void scrollup(unsigned top, unsigned bottom, unsigned n) {
+        ANSI_SCROLL_UP(m_buf, top, bottom, n);
+        m_cx = m_cy = unknown;
+    }
+
+    /* The last glyph went into the right margin; the terminal may be holding a pending wrap. */
+    void pendingwrap() { m_cx = unknown; }
+    void invalidate() { m_cx = m_cy = unknown; m_attrKnown = false; }
+
+    unsigned cursorx() const { return m_cx; }
+    unsigned cursory() const { return m_cy; }
+    std::size_t size() const { return m_buf.size(); }
+
+    /* Running totals since the writer was made. */
+    std::size_t moves() const { return m_moves; }
+    std::size_t sgrchanges() const { return m_sgrChanges; }
+    std::size_t glyphbytes() const { return m_glyphBytes; }
+    std::size_t writes() const { return m_writes; }
+
+    /* Hand the encoded frame over instead of writing it; frame's old contents are dropped.
+     * Swapping keeps both buffers' capacity, so steady use does not allocate. */
+    void take(std::string &frame) {
+        finishframe();
+        frame.clear();
+        std::swap(frame, m_buf);
+    }
+
+    void commit() {
+        finishframe();
+        if(m_buf.empty()) return;
+        m_sink->write(m_buf);
+        m_buf.clear();
+        m_writes++;
+    }
+private:
+    /* With framing on, the cursor goes back to its resting place after every frame; a frame
+     * that only moves it needs no framing. */
+    void finishframe() {
+        if(!m_sync && !m_hideCursor) return;
+        bool park = m_restX != unknown && m_restY != unknown && (m_restX != m_cx || m_restY != m_cy);
+        if(m_buf.empty()) {
+            if(park) move(m_restX, m_restY);
+            return;
+        }
+        if(m_hideCursor) m_buf.insert(0, ANSI_FIXED_SEQ(ansi_fixed::hidecursor));
+        if(m_sync) m_buf.insert(0, ANSI_FIXED_SEQ(ansi_fixed::syncbegin));
+        if(park) move(m_restX, m_restY);
+        if(m_hideCursor) put(ansi_fixed::showcursor);
+        if(m_sync) put(ansi_fixed::syncend);
+    }
+
+    template<color_depth depth>
+    void attrat(const attribs &a) {
+        auto colorchanged = [this](color want, color have) {
+            if constexpr(depth == color_depth::mono) return false;
+            else if constexpr(depth == color_depth::truecolor) return !m_attrKnown || want != have;
+            else return !m_attrKnown || QUANTIZE(want, depth) != QUANTIZE(have, depth);
+        };
+        bool fg = colorchanged(a.fg, m_attr.fg), bg = colorchanged(a.bg, m_attr.bg);
+        if(m_attrKnown && !fg && !bg && a.bold == m_attr.bold && a.underline == m_attr.underline) {
+            m_attr = a;
+            return;
+        }
+        std::size_t start = m_buf.size();
+        m_buf += ANSI_ESCAPE;
+        auto param = [&]() { if(m_buf.size() - start > ANSI_ESCAPE.size()) m_buf += ';'; };
+        if(!m_attrKnown) {
+            m_buf += '0';
+            if(a.bold) m_buf += ";1";
+            if(a.underline) m_buf += ";4";
+        } else {
+            if(a.bold != m_attr.bold) { param(); m_buf += a.bold ? "1" : "22"; }
+            if(a.underline != m_attr.underline) { param(); m_buf += a.underline ? "4" : "24"; }
+        }
+        if(fg) { param(); ANSI_SGR_COLOR<depth>(m_buf, '3', a.fg); }
+        if(bg) { param(); ANSI_SGR_COLOR<depth>(m_buf, '4', a.bg); }
+        m_buf += 'm';
+        m_attr = a;
+        m_attrKnown = true;
+        m_sgrChanges++;
+    }
+
+    std::shared_ptr<sink> m_sink;
+    std::string m_buf;
+    unsigned m_cx{unknown}, m_cy{unknown};
+    attribs m_attr{};
+    bool m_attrKnown{};
+    color_depth m_depth{color_depth::truecolor};
+    bool m_sync{}, m_hideCursor{};
+    unsigned m_restX{unknown}, m_restY{unknown};
+    std::size_t m_moves{}, m_sgrChanges{}, m_glyphBytes{}, m_writes{};
+};
+
+/* Wire format of a delta frame: ops, each a tag byte and LEB128 varints, up to an end tag.
+ * Glyphs travel as the code point plus one, with 0 for the second column of a wide glyph. */
+enum class delta_op : std::uint8_t { end, keyframe, style, forget, scroll, run, cursor };
+
+static void DELTA_UINT(std::string &out, std::uint64_t v) {
+    while(v >= 0x80) { out += static_cast<char>((v & 0x7f) | 0x80); v >>= 7; }
+    out += static_cast<char>(v);
+}
+
+static bool DELTA_READ(std::string_view &in, std::uint64_t &v) {
+    v = 0;
+    for(unsigned shift = 0; shift < 64 && !in.empty(); shift += 7) {
+        auto b = static_cast<unsigned char>(in.front());
+        in.remove_prefix(1);
+        v |= std::uint64_t{b & 0x7fu} << shift;
+        if(b < 0x80) return true;
+    }
+    return false;
+}
+
+/* A backend for streaming screens to other hosts or viewers. screen::flush(delta_encoder &)
+ * runs the same diff as an ANSI flush but encodes each frame as changed runs of cells,
+ * scrolls and the cursor position; a style is sent once and then referred to by number.
+ * Frames go to the sink whole, so a sink fanning them out to many viewers costs one diff
+ * and one encode. A viewer joining later starts from screen::keyframe(). */
+class delta_encoder {
+public:
+    explicit delta_encoder(std::shared_ptr<sink> Sink) : m_sink(std::move(Sink)) {}
+
+    /* Scrolling moves the viewer's cursor to the bottom row, so the cursor is sent again. */
+    void scroll(unsigned n) {
+        m_buf += static_cast<char>(delta_op::scroll);
+        DELTA_UINT(m_buf, n);
+        m_cursorX = m_cursorY = ~0u;
+    }
+
+    /* cells all share the style a. */
+    template<char_type chartype>
+    void run(unsigned x, unsigned y, std::span<const cell<chartype>> cells, const attribs &a) {
+        std::uint32_t id = style(a);
+        std::string &out = *m_target;
+        out += static_cast<char>(delta_op::run);
+        DELTA_UINT(out, y);
+        DELTA_UINT(out, x);
+        DELTA_UINT(out, cells.size());
+        DELTA_UINT(out, id);
+        for(const cell<chartype> &c : cells) {
+            auto chr = static_cast<std::make_unsigned_t<chartype>>(c.chr);
+            DELTA_UINT(out, sizeof(chartype) > 1 && c.chr == std::numeric_limits<chartype>::max() ? 0 : std::uint64_t{chr} + 1);
+        }
+    }
+
+    void cursor(unsigned x, unsigned y) {
+        if(m_target == &m_buf) {
+            if(x == m_cursorX && y == m_cursorY) return;
+            m_cursorX = x; m_cursorY = y;
+        }
+        *m_target += static_cast<char>(delta_op::cursor);
+        DELTA_UINT(*m_target, x);
+        DELTA_UINT(*m_target, y);
+    }
+
+    /* Sends the frame, if it holds anything. */
+    void commit() {
+        if(m_buf.empty()) return;
+        m_buf += static_cast<char>(delta_op::end);
+        m_sink->write(m_buf);
+        m_buf.clear();
+        m_frames++;
+    }
+
+    /* Hands the frame to the caller instead of the sink. */
+    void take(std::string &frame) {
+        frame.clear();
+        if(m_buf.empty()) return;
+        m_buf += static_cast<char>(delta_op::end);
+        std::swap(frame, m_buf);
+        m_frames++;
+    }
+
+    /* A keyframe goes to one viewer only, into frame. It carries every style known so far,
+     * so the stream can carry on from it; a style it has to add is also sent to everyone
+     * else with the next frame. */
+    void beginkeyframe(std::string &frame, unsigned w, unsigned h) {
+        frame.clear();
+        m_target = &frame;
+        frame += static_cast<char>(delta_op::keyframe);
+        DELTA_UINT(frame, w);
+        DELTA_UINT(frame, h);
+        for(const auto &[key, id] : m_ids) define(frame, id, m_attribs[id]);
+    }
+    void endkeyframe() {
+        *m_target += static_cast<char>(delta_op::end);
+        m_target = &m_buf;
+    }
+
+    std::size_t frames() const { return m_frames; }
+private:
+    /* Style numbers are handed out in order and never reused until the table is forgotten,
+     * which happens once it outgrows what a screen can hold. */
+    std::uint32_t style(const attribs &a) {
+        auto it = m_ids.find(a.packed());
+        if(it != m_ids.end()) return it->second;
+        if(m_ids.size() > UINT16_MAX && m_target == &m_buf) {
+            m_buf += static_cast<char>(delta_op::forget);
+            m_ids.clear();
+            m_attribs.clear();
+        }
+        std::uint32_t id = m_attribs.size();
+        m_ids.emplace(a.packed(), id);
+        m_attribs.push_back(a);
+        define(*m_target, id, a);
+        if(m_target != &m_buf) define(m_buf, id, a);
+        return id;
+    }
+
+    static void define(std::string &out, std::uint32_t id, const attribs &a) {
+        out += static_cast<char>(delta_op::style);
+        DELTA_UINT(out, id);
+        for(std::uint8_t v : {a.bg.r, a.bg.g, a.bg.b, a.fg.r, a.fg.g, a.fg.b})
+            out += static_cast<char>(v);
+        out += static_cast<char>(a.bold | a.underline << 1);
+    }
+
+    std::shared_ptr<sink> m_sink;
+    std::string m_buf;
+    std::string *m_target{&m_buf};
+    std::unordered_map<std::uint64_t, std::uint32_t> m_ids;
+    std::vector<attribs> m_attribs;
+    unsigned m_cursorX{~0u}, m_cursorY{~0u};
+    std::size_t m_frames{};
+};
+
+/* Print rhs through o's putc/puts. Characters, numbers and strings are written directly;
+ * anything else goes through a stringstream. */
+template<char_type chartype, typename target, typename T>
+static void formatto(target &o, const T &rhs) {
+    if constexpr(is_character<T>) {
+        o.putc(static_cast<chartype>(rhs));
+    } else if constexpr(std::is_same_v<T, bool>) {
+        o.putc(rhs ? '1' : '0');
+    } else if constexpr(std::is_arithmetic_v<T>) {
+        char buf[64];
+        std::to_chars_result r;
+        if constexpr(std::is_floating_point_v<T>) r = std::to_chars(buf, buf + sizeof(buf), rhs, std::chars_format::general, 6);
+        else r = std::to_chars(buf, buf + sizeof(buf), rhs);
+        for(const char *p = buf; p != r.ptr; p++) o.putc(static_cast<chartype>(*p));
+    } else if constexpr(std::is_convertible_v<const T &, std::basic_string_view<chartype>>) {
+        o.puts(std::basic_string_view<chartype>(rhs));
+    } else {
+        std::basic_stringstream<chartype> ss;
+        ss << rhs;
+        o.puts(ss.str());
+    }
+}
 
 class screen_command_base {};
 
+/* Rows scrolled off the top of a screen, oldest first. A row keeps its glyphs up to the
+ * last one that is not blank, and its attributes as runs, so it costs what it holds rather
+ * than the screen width. Attributes are stored by value because style indices only mean
+ * something to the screen that made them. Rows are packed into chunks that are released
+ * whole once every row in them has been dropped past the limit. */
+template<char_type chartype>
+class scrollback {
+public:
+    struct run {
+        attribs style;
+        std::uint32_t length;
+    };
+    static constexpr std::size_t chunksize = 64 * 1024;
+
+    explicit scrollback(std::size_t Limit, chartype Fill, attribs Blank) : m_limit(Limit), m_fill(Fill), m_blank(Blank) {}
+
+    /* styles maps a cell's style index to its attributes. */
+    template<typename Styles>
+    void push(std::span<const cell<chartype>> r, Styles &&styles) {
+        if(m_limit == 0) return;
+        std::size_t n = r.size();
+        while(n > 0 && blank(r[n - 1].chr, styles(r[n - 1].style))) n--;
+        std::uint32_t runs = 0;
+        for(std::size_t x = 0; x < n; x++)
+            if(x == 0 || r[x].style != r[x - 1].style) runs++;
+        std::size_t need = n * sizeof(chartype) + runs * sizeof(run);
+        if(m_chunks.empty() || m_chunks.back().capacity - m_chunks.back().used < need) {
+            std::size_t capacity = std::max(chunksize, need);
+            m_chunks.push_back(chunk{std::make_unique<std::byte[]>(capacity), 0, capacity});
+            m_bytes += capacity;
+        }
+        chunk &c = m_chunks.back();
+        m_lines.push_back(line{m_chunkBase + m_chunks.size() - 1, c.used, static_cast<std::uint32_t>(n), runs});
+        std::byte *out = c.data.get() + c.used;
+        for(std::size_t x = 0; x < n; x++, out += sizeof(chartype)) std::memcpy(out, &r[x].chr, sizeof(chartype));
+        for(std::size_t x = 0; x < n;) {
+            std::size_t end = x + 1;
+            while(end < n && r[end].style == r[x].style) end++;
+            run u{styles(r[x].style), static_cast<std::uint32_t>(end - x)};
+            std::memcpy(out, &u, sizeof(run));
+            out += sizeof(run);
+            x = end;
+        }
+        c.used += need;
+        while(m_lines.size() > m_limit) m_lines.pop_front();
+        release();
+    }
+
+    /* Unpack row i into out, padding or cropping it to out's width. intern maps attributes
+     * to the style index of the screen being drawn. */
+    template<typename Intern>
+    void read(std::size_t i, std::span<cell<chartype>> out, Intern &&intern) const {
+        assert(i < m_lines.size());
+        const line &l = m_lines[i];
+        const std::byte *in = m_chunks[l.chunk - m_chunkBase].data.get() + l.offset;
+        const std::byte *runs = in + l.chars * sizeof(chartype);
+        std::size_t n = std::min<std::size_t>(l.chars, out.size()), x = 0;
+        for(std::uint32_t k = 0; k < l.runs && x < n; k++) {
+            run u;
+            std::memcpy(&u, runs + k * sizeof(run), sizeof(run));
+            std::uint16_t style = intern(u.style);
+            for(std::size_t end = std::min<std::size_t>(x + u.length, n); x < end; x++) {
+                std::memcpy(&out[x].chr, in + x * sizeof(chartype), sizeof(chartype));
+                out[x].style = style;
+            }
+        }
+        /* A wide glyph cut in half by a narrower screen is dropped. */
+        if(n > 0 && n < l.chars && glyphwidth(out[n - 1].chr) == 2) out[n - 1].chr = m_fill;
+        if(n < out.size()) std::fill(out.begin() + n, out.end(), cell<chartype>{m_fill, intern(m_blank)});
+    }
+
+    std::size_t size() const { return m_lines.size(); }
+    /* Bytes held in chunks, including the unused tail of the newest. */
+    std::size_t bytes() const { return m_bytes; }
+
+    void setlimit(std::size_t limit) {
+        m_limit = limit;
+        while(m_lines.size() > m_limit) m_lines.pop_front();
+        release();
+    }
+    void clear() { setlimit(0); }
+    std::size_t getlimit() const { return m_limit; }
+
+private:
+    struct line {
+        std::size_t chunk, offset;
+        std::uint32_t chars, runs;
+    };
+    struct chunk {
+        std::unique_ptr<std::byte[]> data;
+        std::size_t used, capacity;
+    };
+
+    /* Trailing blanks are dropped and come back in the blank attributes; a space only
+     * shows its background, so its foreground and weight do not matter. */
+    bool blank(chartype c, const attribs &a) const {
+        if(c != m_fill) return false;
+        return a == m_blank || (c == ' ' && a.bg == m_blank.bg && a.underline == m_blank.underline);
+    }
+
+    void release() {
+        std::size_t keep = m_lines.empty() ? m_chunkBase + m_chunks.size() : m_lines.front().chunk;
+        while(m_chunkBase < keep) {
+            m_bytes -= m_chunks.front().capacity;
+            m_chunks.pop_front();
+            m_chunkBase++;
+        }
+    }
+
+    std::size_t m_limit;
+    chartype m_fill;
+    attribs m_blank;
+    std::deque<line> m_lines;
+    std::deque<chunk> m_chunks;
+    std::size_t m_chunkBase{}, m_bytes{};
+};
+
+/* A rectangle of cells together with the styles they refer to, such as a prerendered logo,
+ * legend or table header kept between frames. Made by screen::capture() and drawn with
+ * screen::blit(), which maps the styles into the target screen's table. */
 template<char_type chartype>
+struct image {
+    unsigned width{}, height{};
+    std::vector<cell<chartype>> cells;
+    std::vector<attribs> styles;
+
+    std::span<const cell<chartype>> row(unsigned y) const {
+        return std::span<const cell<chartype>>(cells.data() + std::size_t{y} * width, width);
+    }
+};
+
+template<char_type chartype, typename caps = dynamic_capabilities>
+class view;
+
+/* caps fixes what the terminal supports at compile time; see capabilities. */
+template<char_type chartype, typename caps = dynamic_capabilities>
 class screen {
 public:
-    explicit screen(unsigned X, unsigned Y, unsigned W, unsigned H, chartype C, color B, color F) :
-        m_x(X), m_y(Y), m_width(W), m_height(H), m_front(W * H, cell{C, B, F}), m_back(m_front),
-        m_cursorAttribs(B,F), m_fillChar(C)
+    /* Renders through a writer shared with other screens; the owner of the writer draws it. */
+    explicit screen(std::shared_ptr<writer> Out, unsigned X, unsigned Y, unsigned W, unsigned H, chartype C, color B, color F) :
+        m_x(X), m_y(Y), m_width(W), m_height(H), m_capacity(W * H), m_arena(2 * m_capacity, cell{C}),
+        m_front(m_arena.data(), m_capacity), m_back(m_arena.data() + m_capacity, m_capacity),
+        m_cursorAttribs(B,F), m_fillChar(C), m_styles{attribs{B, F}}, m_styleIndex{{attribs{B, F}.packed(), 0}},
+        m_dirty(H), m_out(std::move(Out)) {}
+
+    explicit screen(std::shared_ptr<sink> Sink, unsigned X, unsigned Y, unsigned W, unsigned H, chartype C, color B, color F) :
+        screen(std::make_shared<writer>(std::move(Sink)), X, Y, W, H, C, B, F)
         {
             redraw();
         }
+    explicit screen(unsigned X, unsigned Y, unsigned W, unsigned H, chartype C, color B, color F) :
+        screen(std::make_shared<ostream_sink>(std::cout), X, Y, W, H, C, B, F) {}
 
     explicit screen(unsigned X, unsigned Y, unsigned W, unsigned H, chartype C) :
         screen(X, Y, W, H, C, color{0, 0, 0}, color{255, 255, 255}) {}
     explicit screen(unsigned X, unsigned Y, unsigned W, unsigned H) : 
         screen(X, Y, W, H, ' ') {}
 
+    /* Moving hands over the arena's storage itself, so m_front and m_back still point into
+     * it. Views of the old screen must be made again. The history has a single owner, so
+     * screens are not copied; capture() an image to duplicate the contents. */
+    screen(screen &&) = default;
+    screen &operator=(screen &&) = default;
+    screen(const screen &) = delete;
+    screen &operator=(const screen &) = delete;
+
     constexpr void setcursorxy(unsigned x, unsigned y) { m_cursorX = x; m_cursorY = y; }
-    constexpr void setcursorfg(uint8_t r, uint8_t g, uint8_t b) { m_cursorAttribs.fg = color{r, g, b}; }
-    constexpr void setcursorbg(uint8_t r, uint8_t g, uint8_t b) { m_cursorAttribs.bg = color{r, g, b}; }
-    constexpr void setcursorbold(bool bold) { m_cursorAttribs.bold = bold; }
-    constexpr void setcursorunderline(bool underline) { m_cursorAttribs.underline = underline; }
+    constexpr void setcursorfg(uint8_t r, uint8_t g, uint8_t b) { m_cursorAttribs.fg = color{r, g, b}; m_cursorStyleValid = false; }
+    constexpr void setcursorbg(uint8_t r, uint8_t g, uint8_t b) { m_cursorAttribs.bg = color{r, g, b}; m_cursorStyleValid = false; }
+    constexpr void setcursorbold(bool bold) { m_cursorAttribs.bold = bold; m_cursorStyleValid = false; }
+    constexpr void setcursorunderline(bool underline) { m_cursorAttribs.underline = underline; m_cursorStyleValid = false; }
+    constexpr void setcursorfg(color c) { setcursorfg(c.r, c.g, c.b); }
+    constexpr void setcursorbg(color c) { setcursorbg(c.r, c.g, c.b); }
 
-    constexpr unsigned getcursorx() { return m_cursorY; }
+    /* Index of a in this screen's style table, adding it if needed. When the table is
+     * full, styles no longer referenced by either buffer are dropped first. */
+    std::uint16_t intern(const attribs &a) {
+        auto it = m_styleIndex.find(a.packed());
+        if(it != m_styleIndex.end()) return it->second;
+        if(m_styles.size() > UINT16_MAX) compactstyles();
+        assert(m_styles.size() <= UINT16_MAX);
+        std::uint16_t style = m_styles.size();
+        m_styles.push_back(a);
+        m_styleIndex.emplace(a.packed(), style);
+        return style;
+    }
+    const attribs &getattribs(std::uint16_t style) const { return m_styles[style]; }
+    chartype getfillchar() const { return m_fillChar; }
+
+    /* Row y as it is shown, copied into out and cropped or padded to its width: live, or
+     * from the history while scrolled back. Adds no styles; history attributes were put in
+     * the table by the flush that drew them, and any that were not get the first style. */
+    void displayrow(unsigned y, std::span<cell<chartype>> out) const {
+        assert(y < m_height);
+        if(y >= m_scrollOffset) {
+            const cell<chartype> *r = m_front.data() + physrow(y - m_scrollOffset) * m_width;
+            std::size_t n = std::min<std::size_t>(out.size(), m_width);
+            std::copy(r, r + n, out.begin());
+            std::fill(out.begin() + n, out.end(), cell<chartype>{m_fillChar});
+            return;
+        }
+        m_history->read(m_history->size() - m_scrollOffset + y, out, [this](const attribs &a) -> std::uint16_t {
+            auto it = m_styleIndex.find(a.packed());
+            return it != m_styleIndex.end() ? it->second : 0;
+        });
+    }
+
+    /* The cell as it will be drawn, without marking anything dirty. */
+    const cell<chartype> &at(unsigned x, unsigned y) const {
+        assert(x < m_width);
+        assert(y < m_height);
+        return m_front[physrow(y) * m_width + x];
+    }
+
+    /* intern() for views on other threads. The table is never compacted here; if it is
+     * full, the screen's initial style is used. */
+    std::uint16_t sharedintern(const attribs &a) {
+        std::lock_guard l(*m_styleMutex);
+        auto it = m_styleIndex.find(a.packed());
+        if(it != m_styleIndex.end()) return it->second;
+        if(m_styles.size() > UINT16_MAX) return 0;
+        return intern(a);
+    }
+
+    constexpr unsigned getcursorx() { return m_cursorX; }
     constexpr unsigned getcursory() { return m_cursorY; }
     constexpr unsigned getx() { return m_x; }
     constexpr unsigned gety() { return m_y; }
     constexpr unsigned getwidth() { return m_width; }
     constexpr unsigned getheight() { return m_height; }
 
-    void clear(const chartype c) { std::fill(m_front.begin(), m_front.end(), cell{c, m_cursorAttribs}); }
+    /* Whether the next flush has anything to diff. */
+    bool dirty() const { return m_dirtyTop < m_dirtyBottom || m_pendingScroll > 0; }
 
+    void clear(const chartype c) {
+        std::fill(m_front.begin(), m_front.end(), cell{c, cursorstyle()});
+        touchall();
+    }
+
+    /* Rows live in a ring starting at m_head, so scrolling only recycles the top row.
+     * With hardware scrolling the next flush scrolls the terminal too and only
+     * repaints the exposed row; dirty spans are stored by physical row and move along. */
     void scroll() {
         m_cursorY = m_height - 1;
-        m_front = std::vector<cell<chartype>>(m_front.begin() + m_width, m_front.end());
-        std::fill(m_front.end() - m_width, m_front.end(), cell{m_fillChar, m_cursorAttribs});
+        auto top = row(0);
+        if(m_history) {
+            m_history->push(top, [this](std::uint16_t style) -> const attribs & { return m_styles[style]; });
+            if(m_scrollOffset > 0) m_scrollOffset = std::min(m_scrollOffset + 1, m_history->size());
+        }
+        std::fill(top.begin(), top.end(), cell{m_fillChar, cursorstyle()});
+        m_head = physrow(1);
+        if(!caps::scrollregion || !m_hwScroll || m_pendingScroll >= m_height || m_scrollOffset > 0) {
+            touchall();
+            return;
+        }
+        m_pendingScroll++;
+        m_dirtyTop = m_dirtyTop > 0 ? m_dirtyTop - 1 : 0;
+        m_dirtyBottom = m_dirtyBottom > 0 ? m_dirtyBottom - 1 : 0;
+        m_dirty[physrow(m_height - 1)] = dirtyspan{0, 0, true};
+        touch(m_height - 1, 0, m_width);
+    }
+
+    /* Keep up to lines rows that scroll off the top; 0 drops the history. */
+    void setscrollback(std::size_t lines) {
+        if(lines == 0) {
+            m_history.reset();
+            setscrolloffset(0);
+            return;
+        }
+        if(!m_history) m_history = std::make_unique<scrollback<chartype>>(lines, m_fillChar, m_styles[0]);
+        else m_history->setlimit(lines);
+        setscrolloffset(m_scrollOffset);
+    }
+    const scrollback<chartype> *getscrollback() const { return m_history.get(); }
+
+    /* Show the screen n rows back into its history. Editing still goes to the live rows, which
+     * reappear as n returns to 0. While scrolled back, new history keeps the view where it is. */
+    void setscrolloffset(std::size_t n) {
+        n = m_history ? std::min(n, m_history->size()) : 0;
+        if(n == m_scrollOffset) return;
+        m_scrollOffset = n;
+        touchall();
+    }
+    std::size_t getscrolloffset() const { return m_scrollOffset; }
+
+    /* Crop or pad to W x H in place, keeping each cell where it was. When the screen gets
+     * shorter, rows above the cursor go to the history so the cursor stays on screen. The back
+     * buffer keeps what the terminal showed at each position, so the next flush only sends
+     * what the new size changes; if the terminal reflowed its contents, redraw() instead.
+     * The buffers only move when they outgrow the arena, which then gets headroom. Views
+     * made before a resize must be made again. */
+    void resize(unsigned W, unsigned H) {
+        if(W == m_width && H == m_height) return;
+        unsigned shift = m_cursorY >= H ? m_cursorY - H + (m_cursorY < m_height) : 0;
+        shift = std::min(shift, m_height);
+        if(m_history)
+            for(unsigned y = 0; y < shift; y++)
+                m_history->push(row(y), [this](std::uint16_t style) -> const attribs & { return m_styles[style]; });
+
+        /* Old rows in order, front then back, so the arena can be rewritten in place. */
+        m_resizeRows.resize(2 * m_width * m_height);
+        for(unsigned y = 0; y < m_height; y++) {
+            std::copy(row(y).begin(), row(y).end(), m_resizeRows.begin() + y * m_width);
+            std::copy(backrow(y).begin(), backrow(y).end(), m_resizeRows.begin() + (m_height + y) * m_width);
+        }
+        std::size_t n = std::size_t{W} * H;
+        if(n > m_capacity) {
+            m_capacity = n + n / 2;
+            m_arena.assign(2 * m_capacity, cell{m_fillChar});
+        }
+        m_front = std::span<cell<chartype>>(m_arena.data(), n);
+        m_back = std::span<cell<chartype>>(m_arena.data() + m_capacity, n);
+
+        cell<chartype> blank{m_fillChar, cursorstyle()};
+        unsigned keepw = std::min(W, m_width);
+        for(unsigned y = 0; y < H; y++) {
+            auto front = m_front.subspan(y * W, W), back = m_back.subspan(y * W, W);
+            std::fill(front.begin(), front.end(), blank);
+            std::fill(back.begin(), back.end(), blank);
+            if(y + shift < m_height) {
+                auto from = m_resizeRows.begin() + (y + shift) * m_width;
+                std::copy(from, from + keepw, front.begin());
+            }
+            if(y < m_height) {
+                auto from = m_resizeRows.begin() + (m_height + y) * m_width;
+                std::copy(from, from + keepw, back.begin());
+            }
+            /* A wide glyph cut in half by a narrower screen is dropped. */
+            if(widecells && W < m_width && W > 0 && glyphwidth(front[W - 1].chr) == 2) front[W - 1].chr = m_fillChar;
+            /* Cells the terminal never showed can never match, which also holds through
+             * further resizes before the next flush. */
+            for(unsigned x = y < m_height ? keepw : 0; x < W; x++) back[x].chr = front[x].chr == 0 ? 1 : 0;
+        }
+
+        m_width = W; m_height = H;
+        m_head = m_backHead = 0;
+        m_dirty.assign(H, dirtyspan{});
+        touchall();
+        m_cursorY -= shift;
+        m_cursorX = std::min(m_cursorX, W);
+        if(m_cursorX == W && m_cursorY < H) { m_cursorX = 0; m_cursorY++; }
+        m_scrollRow.clear();
     }
 
+    /* Off by default, since a screen cannot tell how wide its terminal is: DECSTBM and SU
+     * move whole lines, so only turn it on for a screen spanning every column. */
+    void sethardwarescroll(bool enable) {
+        if(!enable && m_pendingScroll > 0) touchall();
+        m_hwScroll = enable;
+    }
+
+    /* Applies to the writer, and so to every screen sharing it. Takes effect on the next redraw. */
+    void setcolordepth(color_depth depth) { m_out->setcolordepth(depth); }
+    color_depth getcolordepth() const { return caps::fixed ? caps::depth : m_out->getcolordepth(); }
+
     void setc(unsigned x, unsigned y, chartype c) {
         assert(x < m_width);
         assert(y < m_height);
-        m_front[x + (y * m_width)] = cell{c, m_cursorAttribs};
+        place(x, y, c, cursorstyle());
     }
 
     void putc(chartype c){
@@ -112,8 +1138,11 @@ public:
                 m_cursorX = 0; m_cursorY++;
                 break;
             default:
-                (*this)[m_cursorY][m_cursorX++] = 
-                    cell{c, m_cursorAttribs};
+                if(glyphwidth(c) == 2 && m_cursorX + 1 == m_width) {
+                    m_cursorX = 0;
+                    if(++m_cursorY == m_height) scroll();
+                }
+                m_cursorX += place(m_cursorX, m_cursorY, c, cursorstyle());
                 break;
         }
         if(m_cursorX == m_width) {
@@ -122,83 +1151,826 @@ public:
         }
     }
 
-    void puts(const std::basic_string<chartype> &s){
-        for(const chartype &c : s) this->putc(c);
-    }
-    
-    void redraw() {
-        attribs cattr = (*this)[0][0].attr;
-        ANSI_COLOR_BG(cattr.bg);
-        ANSI_COLOR_FG(cattr.fg);
-        for(unsigned y = 0; y < m_height; y++) {
-            ANSI_MOVE(0, y);
-            for(cell c : (*this)[y]) {
-                if(cattr != c.attr) {
-                    cattr = c.attr;
-                    ANSI_COLOR_FG(cattr.fg);
-                    ANSI_COLOR_BG(cattr.bg);
+    /* Copy a run of glyphs with one attribute into row y from column x, clipped to the row.
+     * Runs containing wide glyphs are placed one glyph at a time. */
+    void write(unsigned x, unsigned y, std::span<const chartype> s, std::uint16_t style) {
+        assert(y < m_height);
+        if(x >= m_width || s.empty()) return;
+        if constexpr(widecells) {
+            if(std::any_of(s.begin(), s.end(), [](chartype c) { return glyphwidth(c) != 1; })) {
+                for(chartype c : s) {
+                    if(x + glyphwidth(c) > m_width) break;
+                    x += place(x, y, c, style);
                 }
-                std::cout << c.chr;
+                return;
             }
-            std::cout.clear();
         }
-        m_back = m_front;
+        std::size_t n = std::min<std::size_t>(s.size(), m_width - x);
+        splitwide(y, x, x + n);
+        std::transform(s.begin(), s.begin() + n, row(y).begin() + x,
+                [style](chartype c) { return cell<chartype>{c, style}; });
+        touch(y, x, x + n);
     }
+    void write(unsigned x, unsigned y, std::span<const chartype> s, const attribs &a) { write(x, y, s, intern(a)); }
+    void write(unsigned x, unsigned y, std::span<const chartype> s) { write(x, y, s, cursorstyle()); }
 
-    void flush() {
-        for(unsigned y = 0; y < m_height; y++) {
-            auto backspan = std::span<cell<chartype>>(
-                    m_back.begin() + (y * m_width),
-                    m_back.begin() + (y * m_width) + m_width);
-            auto frontspan = (*this)[y];
-            if(std::equal(backspan.begin(), backspan.end(), frontspan.begin(), frontspan.end())) continue;
-            for(unsigned x = 0; x < m_width; x++) {
-                cell c = frontspan[x];
-                if(c == backspan[x]) continue;
-                ANSI_MOVE(x, y);
-                if(c.attr != backspan[x].attr) {
-                    ANSI_COLOR_FG(c.attr.fg);
-                    ANSI_COLOR_BG(c.attr.bg);
-                }
-                std::cout << c.chr;
+    /* Glyphs for box(): horizontal, vertical, then the top-left, top-right, bottom-left and
+     * bottom-right corners. Wide screens get the light box drawing characters. */
+    static constexpr std::array<chartype, 6> boxglyphs = [] {
+        if constexpr(sizeof(chartype) == 1) return std::array<chartype, 6>{'-', '|', '+', '+', '+', '+'};
+        else return std::array<chartype, 6>{0x2500, 0x2502, 0x250C, 0x2510, 0x2514, 0x2518};
+    }();
+
+    /* Fill the rectangle, clipped to the screen, one span per row. */
+    void fillrect(unsigned x, unsigned y, unsigned w, unsigned h, chartype c, std::uint16_t style) {
+        if(x >= m_width || y >= m_height) return;
+        w = std::min(w, m_width - x); h = std::min(h, m_height - y);
+        if constexpr(widecells) {
+            if(glyphwidth(c) == 2) {
+                for(unsigned j = y; j < y + h; j++)
+                    for(unsigned i = x; i < x + w;) i += place(i, j, c, style, x, x + w);
+                return;
             }
-            std::cout.clear();
         }
-        m_back = m_front;
+        for(unsigned j = y; j < y + h; j++) fillrow(j, x, x + w, cell{c, style});
     }
+    void fillrect(unsigned x, unsigned y, unsigned w, unsigned h, chartype c, const attribs &a) { fillrect(x, y, w, h, c, intern(a)); }
+    void fillrect(unsigned x, unsigned y, unsigned w, unsigned h, chartype c) { fillrect(x, y, w, h, c, cursorstyle()); }
 
-    std::span<cell<chartype>> operator[](std::size_t i) { 
-        assert(i < m_width * m_height);
-        return std::span<cell<chartype>>(
-                m_front.begin() + (i * m_width),
-                m_front.begin() + (i * m_width) + m_width);
+    void hline(unsigned x, unsigned y, unsigned w, chartype c) { fillrect(x, y, w, 1, c); }
+    void vline(unsigned x, unsigned y, unsigned h, chartype c) { fillrect(x, y, 1, h, c); }
+
+    /* Outline the rectangle with glyphs in boxglyphs order; the inside is left alone. */
+    void box(unsigned x, unsigned y, unsigned w, unsigned h, const std::array<chartype, 6> &glyphs = boxglyphs) {
+        if(w < 2 || h < 2 || x >= m_width || y >= m_height) return;
+        std::uint16_t style = cursorstyle();
+        fillrect(x + 1, y, w - 2, 1, glyphs[0], style);
+        fillrect(x + 1, y + h - 1, w - 2, 1, glyphs[0], style);
+        fillrect(x, y + 1, 1, h - 2, glyphs[1], style);
+        fillrect(x + w - 1, y + 1, 1, h - 2, glyphs[1], style);
+        fillrect(x, y, 1, 1, glyphs[2], style);
+        fillrect(x + w - 1, y, 1, 1, glyphs[3], style);
+        fillrect(x, y + h - 1, 1, 1, glyphs[4], style);
+        fillrect(x + w - 1, y + h - 1, 1, 1, glyphs[5], style);
     }
 
-    template<typename T>
-        requires(!std::is_base_of<screen_command_base, T>::value)
-    friend screen &operator<<(screen &o, const T &rhs) {
-        std::basic_stringstream<chartype> ss;
-        ss << rhs;
-        o.puts(ss.str());
-        return o;
+    /* Copy the cells of a rectangle, clipped to the screen, with only the styles they use. */
+    image<chartype> capture(unsigned x, unsigned y, unsigned w, unsigned h) const {
+        image<chartype> img;
+        if(x >= m_width || y >= m_height) return img;
+        img.width = std::min(w, m_width - x); img.height = std::min(h, m_height - y);
+        img.cells.reserve(std::size_t{img.width} * img.height);
+        std::vector<std::uint32_t> remap(m_styles.size(), ~0u);
+        for(unsigned j = y; j < y + img.height; j++) {
+            for(unsigned i = x; i < x + img.width; i++) {
+                cell<chartype> c = at(i, j);
+                if(remap[c.style] == ~0u) {
+                    remap[c.style] = img.styles.size();
+                    img.styles.push_back(m_styles[c.style]);
+                }
+                c.style = remap[c.style];
+                img.cells.push_back(c);
+            }
+        }
+        return img;
     }
 
-private:
-    unsigned m_x{}, m_y{};
-    unsigned m_width{}, m_height{};
+    /* Copy the w x h rectangle at (sx, sy) of src to (dx, dy), clipped to both, a row at a
+     * time. Cells that end up as they were cost nothing at the next flush. */
+    void blit(const image<chartype> &src, unsigned sx, unsigned sy, unsigned w, unsigned h, unsigned dx, unsigned dy) {
+        if(sx >= src.width || sy >= src.height) return;
+        w = std::min(w, src.width - sx); h = std::min(h, src.height - sy);
+        blitrows([&](unsigned j) { return src.row(sy + j).subspan(sx); }, src.styles, false, w, h, dx, dy, false);
+    }
+    void blit(const image<chartype> &src, unsigned dx, unsigned dy) { blit(src, 0, 0, src.width, src.height, dx, dy); }
+    void blit(screen &src, unsigned sx, unsigned sy, unsigned w, unsigned h, unsigned dx, unsigned dy) {
+        if(sx >= src.m_width || sy >= src.m_height) return;
+        w = std::min(w, src.m_width - sx); h = std::min(h, src.m_height - sy);
+        bool same = &src == this;
+        blitrows([&](unsigned j) { return std::span<const cell<chartype>>(src.row(sy + j).subspan(sx)); },
+                src.m_styles, same, w, h, dx, dy, same && dy > sy);
+    }
 
-    std::vector<cell<chartype>> m_front;
-    std::vector<cell<chartype>> m_back;
-    
-    unsigned m_cursorX{}, m_cursorY{};
+    /* Same as putc per character, but lays down each run up to a newline or the row end at once. */
+    void puts(std::basic_string_view<chartype> s){
+        while(!s.empty()) {
+            if(m_cursorY == m_height) {
+                scroll();
+            }
+            if(s.front() == '\n') {
+                m_cursorX = 0; m_cursorY++;
+                s.remove_prefix(1);
+                continue;
+            }
+            std::size_t n = std::min<std::size_t>({s.size(), m_width - m_cursorX, s.find('\n')});
+            if constexpr(widecells) {
+                n = std::find_if(s.begin(), s.begin() + n, [](chartype c) { return glyphwidth(c) != 1; }) - s.begin();
+                if(n == 0) {
+                    putc(s.front());
+                    s.remove_prefix(1);
+                    continue;
+                }
+            }
+            write(m_cursorX, m_cursorY, s.substr(0, n));
+            m_cursorX += n;
+            s.remove_prefix(n);
+            if(m_cursorX == m_width) {
+                m_cursorY++;
+                m_cursorX = 0;
+            }
+        }
+    }
+    
+    void redraw() {
+        m_statsDeferred = true;
+        redraw(*m_out);
+        commit();
+    }
+
+    void flush() {
+        m_statsDeferred = true;
+        flush(*m_out);
+        commit();
+    }
+
+    /* Costs of the last flush or redraw. With stats enabled the phases are timed as well and
+     * the callback, if any, sees every frame once it is complete. */
+    void setstats(bool enabled) { m_statsEnabled = enabled; }
+    void setstatscallback(std::function<void(const flush_stats &)> callback) { m_statsCallback = std::move(callback); }
+    const flush_stats &getstats() const { return m_stats; }
+
+    /* Render into another writer without committing, e.g. from a renderer thread. */
+    void redraw(writer &out) {
+        out.invalidate();
+        redraw(out, [](unsigned, unsigned) { return true; });
+        parkcursor(out);
+    }
+    void flush(writer &out) {
+        flush(out, [](unsigned, unsigned) { return true; });
+        parkcursor(out);
+    }
+
+    /* Applies to the writer, and so to every screen sharing it; see writer::setframing(). */
+    void setframing(bool sync, bool hidecursor) { m_out->setframing(sync, hidecursor); }
+
+    /* Have out leave the terminal cursor at this screen's cursor once the frame is done. */
+    void parkcursor(writer &out) const {
+        if(m_width == 0 || m_height == 0) return;
+        out.setcursor(m_x + std::min(m_cursorX, m_width - 1), m_y + std::min(m_cursorY, m_height - 1));
+    }
+
+    /* Repaint every cell for which visible(x, y) holds into out, without committing. */
+    template<typename Visible>
+    void redraw(writer &out, Visible &&visible) {
+        statsbegin(out);
+        for(unsigned y = 0; y < m_height; y++) {
+            auto frontspan = displayrow(y);
+            for(unsigned x = 0; x < m_width; x++) {
+                if(!visible(x, y) || drawnwithlead(frontspan, x, y, visible)) continue;
+                emit(out, frontspan, x, y, visible);
+            }
+            if(m_scrollOffset > 0) std::copy(frontspan.begin(), frontspan.end(), m_back.begin() + y * m_width);
+        }
+        if(m_scrollOffset > 0) m_backHead = 0;
+        else {
+            std::copy(m_front.begin(), m_front.end(), m_back.begin());
+            m_backHead = m_head;
+        }
+        m_pendingScroll = 0;
+        std::fill(m_dirty.begin(), m_dirty.end(), dirtyspan{});
+        m_dirtyTop = m_height; m_dirtyBottom = 0;
+        statsend(out);
+    }
+
+    /* Emit the changes since the last flush for cells where visible(x, y) holds into out,
+     * without committing. Only cells that actually changed are written back into the back
+     * buffer, hidden ones included, so a clear() that repaints the same content costs a
+     * diff and nothing more. */
+    template<typename Visible>
+    void flush(writer &out, Visible &&visible) {
+        statsbegin(out);
+        /* Edits to live rows land at other terminal rows while scrolled back, so every row is diffed. */
+        if(m_scrollOffset > 0) touchall();
+        if(m_pendingScroll > 0) {
+            if(m_pendingScroll < m_height) out.scrollup(m_y, m_y + m_height, m_pendingScroll);
+            m_backHead = (m_backHead + m_pendingScroll) % m_height;
+            m_pendingScroll = 0;
+        }
+        for(unsigned y = m_dirtyTop; y < m_dirtyBottom; y++) {
+            dirtyspan &d = m_dirty[physrow(y)];
+            if(d.lo >= d.hi) continue;
+            auto backspan = backrow(y);
+            auto frontspan = displayrow(y);
+            unsigned sent = ~0u;
+            for(unsigned x = d.lo; x < d.hi; x++) {
+                if(!d.exposed) {
+                    std::size_t same;
+                    if(m_statsEnabled) {
+                        auto start = std::chrono::steady_clock::now();
+                        same = firstdiff(frontspan.data() + x, backspan.data() + x, d.hi - x);
+                        m_stats.diff += std::chrono::steady_clock::now() - start;
+                    } else same = firstdiff(frontspan.data() + x, backspan.data() + x, d.hi - x);
+                    m_stats.cellsdiffed += std::min<std::size_t>(same + 1, d.hi - x);
+                    x += same;
+                    if(x == d.hi) break;
+                }
+                backspan[x] = frontspan[x];
+                if(!visible(x, y)) continue;
+                if(drawnwithlead(frontspan, x, y, visible)) {
+                    /* An unchanged lead may be showing as fill from when the tail held something else. */
+                    if(sent != x - 1) emit(out, frontspan, x - 1, y, visible);
+                    continue;
+                }
+                unsigned cx = out.cursorx();
+                const attribs *cattr = out.currentattr();
+                std::size_t cost = out.movecost(m_x + x, m_y + y);
+                if(cattr && out.cursory() == m_y + y && cx >= m_x && cx < m_x + x && m_x + x - cx < cost) {
+                    unsigned gx = cx - m_x;
+                    std::size_t bytes = 0;
+                    bool reprint = !(widecells && frontspan[gx].chr == widetail);
+                    /* Only cells emit() would send as they are: visible, and wide glyphs whole. */
+                    for(unsigned g = gx; g < x && reprint; g++) {
+                        const cell<chartype> &gc = frontspan[g];
+                        reprint = visible(g, y);
+                        if(widecells && gc.chr == widetail) {
+                            reprint = reprint && g > gx && glyphwidth(frontspan[g - 1].chr) == 2;
+                            continue;
+                        }
+                        unsigned w = glyphwidth(gc.chr);
+                        reprint = reprint && m_styles[gc.style] == *cattr && g + w <= x &&
+                            (w != 2 || (frontspan[g + 1].chr == widetail && visible(g + 1, y)));
+                        bytes += glyphbytes(gc.chr);
+                    }
+                    if(reprint && bytes < cost)
+                        for(; gx < x; gx++) if(!(widecells && frontspan[gx].chr == widetail)) { out.template glyph<caps>(frontspan[gx].chr); m_stats.cellsemitted++; }
+                }
+                emit(out, frontspan, x, y, visible);
+                sent = x;
+            }
+            d = dirtyspan{};
+        }
+        m_dirtyTop = m_height; m_dirtyBottom = 0;
+        statsend(out);
+    }
+
+    /* The same diff as flush(), encoded for a delta_encoder and committed to it. Scrolls
+     * held for the terminal are sent as scroll ops, and each row's changes as runs of
+     * changed cells sharing a style. The back buffer is shared with the ANSI path, so a
+     * screen is streamed through one or the other. */
+    void flush(delta_encoder &out) {
+        if(m_scrollOffset > 0) touchall();
+        if(m_pendingScroll > 0) {
+            if(m_pendingScroll < m_height) out.scroll(m_pendingScroll);
+            m_backHead = (m_backHead + m_pendingScroll) % m_height;
+            m_pendingScroll = 0;
+        }
+        for(unsigned y = m_dirtyTop; y < m_dirtyBottom; y++) {
+            dirtyspan &d = m_dirty[physrow(y)];
+            if(d.lo >= d.hi) continue;
+            auto backspan = backrow(y);
+            auto frontspan = displayrow(y);
+            for(unsigned x = d.lo; x < d.hi; ) {
+                if(!d.exposed) {
+                    x += firstdiff(frontspan.data() + x, backspan.data() + x, d.hi - x);
+                    if(x == d.hi) break;
+                }
+                unsigned end = x + 1;
+                while(end < d.hi && frontspan[end].style == frontspan[x].style && (d.exposed || frontspan[end] != backspan[end])) end++;
+                std::copy(frontspan.begin() + x, frontspan.begin() + end, backspan.begin() + x);
+                out.run(x, y, std::span<const cell<chartype>>(frontspan.data() + x, end - x), m_styles[frontspan[x].style]);
+                x = end;
+            }
+            d = dirtyspan{};
+        }
+        m_dirtyTop = m_height; m_dirtyBottom = 0;
+        out.cursor(m_cursorX, m_cursorY);
+        out.commit();
+    }
+
+    /* A frame a viewer joining the stream starts from: the size, every row and the cursor.
+     * Nothing is marked clean, so it matches the stream only when taken right after
+     * flush(delta_encoder &). */
+    void keyframe(delta_encoder &out, std::string &frame) {
+        out.beginkeyframe(frame, m_width, m_height);
+        for(unsigned y = 0; y < m_height; y++) {
+            auto r = displayrow(y);
+            for(unsigned x = 0, end; x < m_width; x = end) {
+                for(end = x + 1; end < m_width && r[end].style == r[x].style; end++);
+                out.run(x, y, std::span<const cell<chartype>>(r.data() + x, end - x), m_styles[r[x].style]);
+            }
+        }
+        out.cursor(m_cursorX, m_cursorY);
+        out.endkeyframe();
+    }
+
+    /* Hands out the row for writing, so the whole row is assumed changed. */
+    std::span<cell<chartype>> operator[](std::size_t i) {
+        assert(i < m_height);
+        touch(i, 0, m_width);
+        return row(i);
+    }
+
+    template<typename T>
+        requires(!std::is_base_of<screen_command_base, T>::value)
+    friend screen &operator<<(screen &o, const T &rhs) {
+        formatto<chartype>(o, rhs);
+        return o;
+    }
+
+private:
+    template<char_type, typename> friend class view;
+    template<char_type> friend class delta_decoder;
+
+    /* Columns [lo, hi) of a row that may differ from the back buffer.
+     * An exposed row was scrolled in on the terminal, so the back buffer says nothing about it. */
+    struct dirtyspan {
+        unsigned lo{~0u}, hi{0};
+        bool exposed{};
+    };
+
+    std::size_t physrow(std::size_t y) const {
+        std::size_t p = y + m_head;
+        return p < m_height ? p : p - m_height;
+    }
+    std::span<cell<chartype>> row(std::size_t y) {
+        return std::span<cell<chartype>>(m_front.begin() + (physrow(y) * m_width), m_width);
+    }
+    std::span<cell<chartype>> backrow(std::size_t y) {
+        std::size_t p = y + m_backHead;
+        if(p >= m_height) p -= m_height;
+        return std::span<cell<chartype>>(m_back.begin() + (p * m_width), m_width);
+    }
+
+    void touch(unsigned y, unsigned lo, unsigned hi) {
+        dirtyspan &d = m_dirty[physrow(y)];
+        d.lo = std::min(d.lo, lo);
+        d.hi = std::max(d.hi, hi);
+        m_dirtyTop = std::min(m_dirtyTop, y);
+        m_dirtyBottom = std::max(m_dirtyBottom, y + 1);
+    }
+    static constexpr bool widecells = sizeof(chartype) > 1;
+    /* Marks the second column of a wide glyph; it is never sent on its own. */
+    static constexpr chartype widetail = std::numeric_limits<chartype>::max();
+
+    /* Same as touch, but safe against views marking the same row from other threads. */
+    void sharedtouch(unsigned y, unsigned lo, unsigned hi) {
+        auto lower = [](unsigned &v, unsigned to) {
+            std::atomic_ref<unsigned> a(v);
+            unsigned cur = a.load(std::memory_order_relaxed);
+            while(to < cur && !a.compare_exchange_weak(cur, to, std::memory_order_relaxed));
+        };
+        auto raise = [](unsigned &v, unsigned to) {
+            std::atomic_ref<unsigned> a(v);
+            unsigned cur = a.load(std::memory_order_relaxed);
+            while(to > cur && !a.compare_exchange_weak(cur, to, std::memory_order_relaxed));
+        };
+        dirtyspan &d = m_dirty[physrow(y)];
+        lower(d.lo, lo);
+        raise(d.hi, hi);
+        lower(m_dirtyTop, y);
+        raise(m_dirtyBottom, y + 1);
+    }
+    template<bool shared>
+    void touch(unsigned y, unsigned lo, unsigned hi) {
+        if constexpr(shared) sharedtouch(y, lo, hi);
+        else touch(y, lo, hi);
+    }
+
+    /* Store c at (x, y), taking two columns for a wide glyph. One that does not fit before
+     * column right is replaced with the fill character. Returns the columns used. */
+    template<bool shared = false>
+    unsigned place(unsigned x, unsigned y, chartype c, std::uint16_t style, unsigned left, unsigned right) {
+        unsigned w = glyphwidth(c);
+        if(w == 2 && x + 1 >= right) { c = m_fillChar; w = 1; }
+        splitwide<shared>(y, x, x + w, left, right);
+        auto r = row(y);
+        r[x] = cell{c, style};
+        if(w == 2) r[x + 1] = cell{widetail, style};
+        touch<shared>(y, x, x + w);
+        return w;
+    }
+    unsigned place(unsigned x, unsigned y, chartype c, std::uint16_t style) { return place(x, y, c, style, 0, m_width); }
+
+    /* Rows go through a scratch row, so a source overlapping the destination is read before
+     * it is overwritten; bottomup does the same for rows. Styles are mapped on first use,
+     * unless the source is this screen. */
+    template<typename Rows>
+    void blitrows(Rows &&rows, std::span<const attribs> styles, bool same, unsigned w, unsigned h,
+            unsigned dx, unsigned dy, bool bottomup) {
+        if(dx >= m_width || dy >= m_height) return;
+        w = std::min(w, m_width - dx); h = std::min(h, m_height - dy);
+        if(w == 0) return;
+        if(!same) m_blitStyles.assign(styles.size(), ~0u);
+        for(unsigned k = 0; k < h; k++) {
+            unsigned j = bottomup ? h - 1 - k : k;
+            auto from = rows(j);
+            m_blitRow.assign(from.begin(), from.begin() + w);
+            if(!same) {
+                for(cell<chartype> &c : m_blitRow) {
+                    if(m_blitStyles[c.style] == ~0u) m_blitStyles[c.style] = intern(styles[c.style]);
+                    c.style = m_blitStyles[c.style];
+                }
+            }
+            if constexpr(widecells) {
+                /* Halves of wide glyphs cut off by the rectangle are dropped. */
+                if(m_blitRow.front().chr == widetail) m_blitRow.front().chr = m_fillChar;
+                if(glyphwidth(m_blitRow.back().chr) == 2) m_blitRow.back().chr = m_fillChar;
+            }
+            splitwide(dy + j, dx, dx + w);
+            std::copy(m_blitRow.begin(), m_blitRow.end(), row(dy + j).begin() + dx);
+            touch(dy + j, dx, dx + w);
+        }
+    }
+
+    void fillrow(unsigned y, unsigned lo, unsigned hi, cell<chartype> c) {
+        splitwide(y, lo, hi);
+        std::fill_n(row(y).begin() + lo, hi - lo, c);
+        touch(y, lo, hi);
+    }
+
+    /* Blank the other half of any wide glyph that overwriting columns [lo, hi) would cut,
+     * as long as that half lies within [left, right). */
+    template<bool shared = false>
+    void splitwide(unsigned y, unsigned lo, unsigned hi, unsigned left, unsigned right) {
+        if constexpr(widecells) {
+            auto r = row(y);
+            if(lo > left && r[lo].chr == widetail) { r[lo - 1].chr = m_fillChar; touch<shared>(y, lo - 1, lo); }
+            if(hi < right && r[hi].chr == widetail) { r[hi].chr = m_fillChar; touch<shared>(y, hi, hi + 1); }
+        }
+    }
+    void splitwide(unsigned y, unsigned lo, unsigned hi) { splitwide(y, lo, hi, 0, m_width); }
+
+    template<typename Visible>
+    bool drawnwithlead(std::span<cell<chartype>> r, unsigned x, unsigned y, Visible &visible) {
+        if constexpr(widecells) return r[x].chr == widetail && x > 0 && glyphwidth(r[x - 1].chr) == 2 && visible(x - 1, y);
+        else return false;
+    }
+
+    /* Send the glyph at column x. A wide glyph whose second half is hidden or off the
+     * screen, or a tail whose lead is hidden, is sent as the fill character instead. So is
+     * either half once a view has overwritten the other across its edge. */
+    template<typename Visible>
+    void emit(writer &out, std::span<cell<chartype>> r, unsigned x, unsigned y, Visible &visible) {
+        chartype c = r[x].chr;
+        unsigned w = glyphwidth(c);
+        if constexpr(widecells) {
+            if(c == widetail || (w == 2 && (x + 1 >= m_width || r[x + 1].chr != widetail || !visible(x + 1, y)))) { c = m_fillChar; w = 1; }
+        }
+        out.move(m_x + x, m_y + y);
+        out.template attr<caps>(m_styles[r[x].style]);
+        out.template glyph<caps>(c);
+        if(x + w >= m_width) out.pendingwrap();
+        m_stats.cellsemitted++;
+    }
+
+    /* The writer's totals at the start of a frame; statsend() turns them into this frame's
+     * share. cellsdiffed counts the cells handed to firstdiff, and diff and encode split the
+     * frame's wall time between those calls and everything else. */
+    void statsbegin(const writer &out) {
+        m_stats = flush_stats{};
+        m_statsStart = {out.size(), out.glyphbytes(), out.moves(), out.sgrchanges()};
+        if(m_statsEnabled) m_statsClock = std::chrono::steady_clock::now();
+    }
+    void statsend(const writer &out) {
+        m_stats.glyphbytes = out.glyphbytes() - m_statsStart[1];
+        m_stats.escapebytes = out.size() - m_statsStart[0] - m_stats.glyphbytes;
+        m_stats.moves = out.moves() - m_statsStart[2];
+        m_stats.sgrchanges = out.sgrchanges() - m_statsStart[3];
+        if(m_statsEnabled) m_stats.encode = std::chrono::steady_clock::now() - m_statsClock - m_stats.diff;
+        if(!m_statsDeferred) report();
+    }
+    void commit() {
+        if(m_statsEnabled) {
+            std::size_t writes = m_out->writes();
+            auto start = std::chrono::steady_clock::now();
+            m_out->commit();
+            m_stats.write = std::chrono::steady_clock::now() - start;
+            m_stats.writes = m_out->writes() - writes;
+        } else m_out->commit();
+        m_statsDeferred = false;
+        report();
+    }
+    void report() {
+        if(m_statsEnabled && m_statsCallback) m_statsCallback(m_stats);
+    }
+
+    std::uint16_t cursorstyle() {
+        if(!m_cursorStyleValid) {
+            m_cursorStyle = intern(m_cursorAttribs);
+            m_cursorStyleValid = true;
+        }
+        return m_cursorStyle;
+    }
+
+    /* Renumbers styles, so views drop their cached style when the generation moves. The
+     * screen's initial style stays at 0, where lookups that find nothing fall back to. */
+    void compactstyles() {
+        std::vector<std::uint16_t> remap(m_styles.size(), UINT16_MAX);
+        remap[0] = 0;
+        for(const cell<chartype> &c : m_front) remap[c.style] = 0;
+        for(const cell<chartype> &c : m_back) remap[c.style] = 0;
+        std::vector<attribs> styles;
+        m_styleIndex.clear();
+        for(std::size_t i = 0; i < remap.size(); i++) {
+            if(remap[i] == UINT16_MAX) continue;
+            remap[i] = styles.size();
+            m_styleIndex.emplace(m_styles[i].packed(), remap[i]);
+            styles.push_back(m_styles[i]);
+        }
+        for(cell<chartype> &c : m_front) c.style = remap[c.style];
+        for(cell<chartype> &c : m_back) c.style = remap[c.style];
+        m_styles = std::move(styles);
+        m_cursorStyleValid = false;
+        m_styleGeneration++;
+    }
+
+    /* Row y as it is shown: live, or from the history while scrolled back. History rows are
+     * unpacked into a scratch row that is only valid until the next call. */
+    std::span<cell<chartype>> displayrow(unsigned y) {
+        if(y >= m_scrollOffset) return row(y - m_scrollOffset);
+        m_scrollRow.resize(m_width);
+        m_history->read(m_history->size() - m_scrollOffset + y, m_scrollRow, [this](const attribs &a) { return intern(a); });
+        return m_scrollRow;
+    }
+
+    void touchall() {
+        std::fill(m_dirty.begin(), m_dirty.end(), dirtyspan{0, m_width});
+        m_pendingScroll = 0;
+        m_dirtyTop = 0; m_dirtyBottom = m_height;
+    }
+
+    unsigned m_x{}, m_y{};
+    unsigned m_width{}, m_height{};
+
+    /* Both buffers live in one arena, each with room for m_capacity cells. */
+    std::size_t m_capacity{};
+    std::vector<cell<chartype>> m_arena;
+    std::span<cell<chartype>> m_front;
+    std::span<cell<chartype>> m_back;
+    std::vector<cell<chartype>> m_resizeRows;
+    std::vector<cell<chartype>> m_blitRow;
+    std::vector<std::uint32_t> m_blitStyles;
+    unsigned m_head{}, m_backHead{};
+    unsigned m_pendingScroll{};
+    bool m_hwScroll{};
+    
+    unsigned m_cursorX{}, m_cursorY{};
     attribs m_cursorAttribs;
     chartype m_fillChar;
+
+    std::vector<attribs> m_styles;
+    std::unordered_map<std::uint64_t, std::uint16_t> m_styleIndex;
+    std::uint16_t m_cursorStyle{};
+    bool m_cursorStyleValid{};
+    std::uint32_t m_styleGeneration{};
+    /* Out of line so the screen stays movable. */
+    std::unique_ptr<std::mutex> m_styleMutex{std::make_unique<std::mutex>()};
+
+    std::vector<dirtyspan> m_dirty;
+    unsigned m_dirtyTop{}, m_dirtyBottom{};
+
+    std::shared_ptr<writer> m_out;
+
+    std::unique_ptr<scrollback<chartype>> m_history;
+    std::size_t m_scrollOffset{};
+    std::vector<cell<chartype>> m_scrollRow;
+
+    flush_stats m_stats;
+    std::array<std::size_t, 4> m_statsStart{};
+    std::chrono::steady_clock::time_point m_statsClock;
+    bool m_statsEnabled{}, m_statsDeferred{};
+    std::function<void(const flush_stats &)> m_statsCallback;
+};
+
+/* Applies frames from a delta_encoder to a screen, typically on another host, which then
+ * flushes to its own terminal as usual. A keyframe resizes the screen to match; otherwise
+ * both are expected to be the same size, and runs that do not fit are rejected. */
+template<char_type chartype>
+class delta_decoder {
+public:
+    /* false if the frame is malformed; everything before the fault has been applied. */
+    template<typename caps>
+    bool apply(screen<chartype, caps> &s, std::string_view frame) {
+        std::uint64_t a, b, c, d;
+        while(!frame.empty()) {
+            auto op = static_cast<delta_op>(frame.front());
+            frame.remove_prefix(1);
+            switch(op) {
+            case delta_op::end:
+                return frame.empty();
+            case delta_op::keyframe:
+                if(!DELTA_READ(frame, a) || !DELTA_READ(frame, b) || a == 0 || b == 0 || a > maxcells / b) return false;
+                if(a != s.getwidth() || b != s.getheight()) s.resize(a, b);
+                m_styles.clear();
+                break;
+            case delta_op::style:
+                if(!DELTA_READ(frame, a) || a > maxstyles || frame.size() < 7) return false;
+                if(a >= m_styles.size()) m_styles.resize(a + 1);
+                m_styles[a] = attribs(color(frame[0], frame[1], frame[2]), color(frame[3], frame[4], frame[5]),
+                        frame[6] & 1, frame[6] & 2);
+                frame.remove_prefix(7);
+                break;
+            case delta_op::forget:
+                m_styles.clear();
+                break;
+            case delta_op::scroll:
+                if(!DELTA_READ(frame, a)) return false;
+                for(std::uint64_t i = 0; i < std::min<std::uint64_t>(a, s.getheight()); i++) s.scroll();
+                break;
+            case delta_op::run: {
+                if(!DELTA_READ(frame, a) || !DELTA_READ(frame, b) || !DELTA_READ(frame, c) || !DELTA_READ(frame, d)) return false;
+                if(a >= s.getheight() || b > s.getwidth() || c > s.getwidth() - b || d >= m_styles.size()) return false;
+                unsigned y = a, x = b, n = c;
+                std::uint16_t style = s.intern(m_styles[d]);
+                auto r = s.row(y);
+                for(unsigned i = 0; i < n; i++) {
+                    if(!DELTA_READ(frame, a)) return false;
+                    r[x + i] = cell<chartype>(a == 0 ? std::numeric_limits<chartype>::max() : static_cast<chartype>(a - 1), style);
+                }
+                s.touch(y, x, x + n);
+                break;
+            }
+            case delta_op::cursor:
+                if(!DELTA_READ(frame, a) || !DELTA_READ(frame, b)) return false;
+                s.setcursorxy(a, b);
+                break;
+            default:
+                return false;
+            }
+        }
+        return false;
+    }
+private:
+    static constexpr std::uint64_t maxstyles = 2 * (UINT16_MAX + 1);
+    /* Keyframes beyond this are rejected rather than allocated. */
+    static constexpr std::uint64_t maxcells = std::uint64_t{1} << 20;
+    std::vector<attribs> m_styles;
+};
+
+/* A window onto a rectangle of a screen with its own cursor and attributes, writing
+ * straight into the screen's cells and dirty tracking; output is clipped to the rectangle
+ * and scrolls within it. Views over disjoint rectangles can be written from different threads at
+ * once without locking: each only stores its own cells and marks dirty spans atomically.
+ * They must not be used concurrently with the screen's own methods, flush included.
+ * Resolving changed attributes to a style takes a short lock. */
+template<char_type chartype, typename caps>
+class view {
+public:
+    explicit view(screen<chartype, caps> &S, unsigned X, unsigned Y, unsigned W, unsigned H) :
+        m_screen(S), m_x(std::min(X, S.getwidth())), m_y(std::min(Y, S.getheight())),
+        m_width(std::min(W, S.getwidth() - m_x)), m_height(std::min(H, S.getheight() - m_y)),
+        m_cursorAttribs(S.m_cursorAttribs) {}
+
+    constexpr void setcursorxy(unsigned x, unsigned y) { m_cursorX = x; m_cursorY = y; }
+    constexpr void setcursorfg(uint8_t r, uint8_t g, uint8_t b) { m_cursorAttribs.fg = color{r, g, b}; m_cursorStyleValid = false; }
+    constexpr void setcursorbg(uint8_t r, uint8_t g, uint8_t b) { m_cursorAttribs.bg = color{r, g, b}; m_cursorStyleValid = false; }
+    constexpr void setcursorbold(bool bold) { m_cursorAttribs.bold = bold; m_cursorStyleValid = false; }
+    constexpr void setcursorunderline(bool underline) { m_cursorAttribs.underline = underline; m_cursorStyleValid = false; }
+    constexpr void setcursorfg(color c) { setcursorfg(c.r, c.g, c.b); }
+    constexpr void setcursorbg(color c) { setcursorbg(c.r, c.g, c.b); }
+
+    constexpr unsigned getcursorx() { return m_cursorX; }
+    constexpr unsigned getcursory() { return m_cursorY; }
+    constexpr unsigned getx() { return m_x; }
+    constexpr unsigned gety() { return m_y; }
+    constexpr unsigned getwidth() { return m_width; }
+    constexpr unsigned getheight() { return m_height; }
+
+    void clear(const chartype c) {
+        if(m_width == 0) return;
+        std::uint16_t style = cursorstyle();
+        for(unsigned y = m_y; y < m_y + m_height; y++) {
+            auto r = m_screen.row(y).subspan(m_x, m_width);
+            std::fill(r.begin(), r.end(), cell<chartype>{c, style});
+            m_screen.sharedtouch(y, m_x, m_x + m_width);
+        }
+    }
+
+    /* Moves the view's rows up by one within the parent's buffer; the screen's diff then
+     * sends only what actually changed on the terminal. */
+    void scroll() {
+        m_cursorY = m_height - 1;
+        if(m_width == 0 || m_height == 0) return;
+        for(unsigned y = m_y; y + 1 < m_y + m_height; y++) {
+            auto from = m_screen.row(y + 1).subspan(m_x, m_width);
+            std::copy(from.begin(), from.end(), m_screen.row(y).begin() + m_x);
+            m_screen.sharedtouch(y, m_x, m_x + m_width);
+        }
+        auto last = m_screen.row(m_y + m_height - 1).subspan(m_x, m_width);
+        std::fill(last.begin(), last.end(), cell<chartype>{m_screen.m_fillChar, cursorstyle()});
+        m_screen.sharedtouch(m_y + m_height - 1, m_x, m_x + m_width);
+    }
+
+    void setc(unsigned x, unsigned y, chartype c) {
+        assert(x < m_width);
+        assert(y < m_height);
+        m_screen.template place<true>(m_x + x, m_y + y, c, cursorstyle(), m_x, m_x + m_width);
+    }
+
+    void putc(chartype c) {
+        if(m_width == 0 || m_height == 0) return;
+        if(m_cursorY == m_height) {
+            scroll();
+        }
+        if(c == '\n') {
+            m_cursorX = 0; m_cursorY++;
+            return;
+        }
+        if(glyphwidth(c) == 2 && m_cursorX + 1 == m_width) {
+            m_cursorX = 0;
+            if(++m_cursorY == m_height) scroll();
+        }
+        m_cursorX += m_screen.template place<true>(m_x + m_cursorX, m_y + m_cursorY, c, cursorstyle(), m_x, m_x + m_width);
+        if(m_cursorX == m_width) {
+            m_cursorY++;
+            m_cursorX = 0;
+        }
+    }
+
+    void write(unsigned x, unsigned y, std::span<const chartype> s, std::uint16_t style) {
+        assert(y < m_height);
+        if(x >= m_width || s.empty()) return;
+        unsigned sx = m_x + x, sy = m_y + y, right = m_x + m_width;
+        if constexpr(screen<chartype, caps>::widecells) {
+            if(std::any_of(s.begin(), s.end(), [](chartype c) { return glyphwidth(c) != 1; })) {
+                for(chartype c : s) {
+                    if(sx + glyphwidth(c) > right) break;
+                    sx += m_screen.template place<true>(sx, sy, c, style, m_x, right);
+                }
+                return;
+            }
+        }
+        std::size_t n = std::min<std::size_t>(s.size(), m_width - x);
+        m_screen.template splitwide<true>(sy, sx, sx + n, m_x, right);
+        std::transform(s.begin(), s.begin() + n, m_screen.row(sy).begin() + sx,
+                [style](chartype c) { return cell<chartype>{c, style}; });
+        m_screen.sharedtouch(sy, sx, sx + n);
+    }
+    void write(unsigned x, unsigned y, std::span<const chartype> s, const attribs &a) { write(x, y, s, m_screen.sharedintern(a)); }
+    void write(unsigned x, unsigned y, std::span<const chartype> s) { write(x, y, s, cursorstyle()); }
+
+    void puts(std::basic_string_view<chartype> s) {
+        if(m_width == 0 || m_height == 0) return;
+        while(!s.empty()) {
+            if(m_cursorY == m_height) {
+                scroll();
+            }
+            if(s.front() == '\n') {
+                m_cursorX = 0; m_cursorY++;
+                s.remove_prefix(1);
+                continue;
+            }
+            std::size_t n = std::min<std::size_t>({s.size(), m_width - m_cursorX, s.find('\n')});
+            if constexpr(screen<chartype, caps>::widecells) {
+                n = std::find_if(s.begin(), s.begin() + n, [](chartype c) { return glyphwidth(c) != 1; }) - s.begin();
+                if(n == 0) {
+                    putc(s.front());
+                    s.remove_prefix(1);
+                    continue;
+                }
+            }
+            write(m_cursorX, m_cursorY, s.substr(0, n));
+            m_cursorX += n;
+            s.remove_prefix(n);
+            if(m_cursorX == m_width) {
+                m_cursorY++;
+                m_cursorX = 0;
+            }
+        }
+    }
+
+    template<typename T>
+        requires(!std::is_base_of<screen_command_base, T>::value)
+    friend view &operator<<(view &o, const T &rhs) {
+        formatto<chartype>(o, rhs);
+        return o;
+    }
+
+private:
+    std::uint16_t cursorstyle() {
+        if(!m_cursorStyleValid || m_styleGeneration != m_screen.m_styleGeneration) {
+            m_cursorStyle = m_screen.sharedintern(m_cursorAttribs);
+            m_cursorStyleValid = true;
+            m_styleGeneration = m_screen.m_styleGeneration;
+        }
+        return m_cursorStyle;
+    }
+
+    screen<chartype, caps> &m_screen;
+    unsigned m_x{}, m_y{};
+    unsigned m_width{}, m_height{};
+
+    unsigned m_cursorX{}, m_cursorY{};
+    attribs m_cursorAttribs;
+    std::uint16_t m_cursorStyle{};
+    bool m_cursorStyleValid{};
+    std::uint32_t m_styleGeneration{};
 };
 
 struct screen_command_flush : public screen_command_base {
     explicit screen_command_flush() = default;
-    template<char_type T>
-    friend screen<T> &operator<<(screen<T> &o, const screen_command_flush &cmd) {
+    template<char_type T, typename caps>
+    friend screen<T, caps> &operator<<(screen<T, caps> &o, const screen_command_flush &cmd) {
         (void)cmd;
         o.flush();
         return o;
@@ -210,7 +1982,13 @@ template<char_type chartype>
 struct screen_command_clear : public screen_command_base {
     chartype c;
     explicit screen_command_clear(chartype C) : c(C) {}
-    friend screen<chartype> &operator<<(screen<chartype> &o, const screen_command_clear &cmd) {
+    template<typename caps>
+    friend screen<chartype, caps> &operator<<(screen<chartype, caps> &o, const screen_command_clear &cmd) {
+        o.clear(cmd.c);
+        return o;
+    }
+    template<typename caps>
+    friend view<chartype, caps> &operator<<(view<chartype, caps> &o, const screen_command_clear &cmd) {
         o.clear(cmd.c);
         return o;
     }
@@ -223,8 +2001,13 @@ template<char_type chartype>
 struct screen_command_move : public screen_command_base {
     unsigned x, y;
     explicit screen_command_move(unsigned X, unsigned Y) : x(X), y(Y) {}
-    template<char_type T>
-    friend screen<T> &operator<<(screen<T> &o, const screen_command_move &cmd) {
+    template<char_type T, typename caps>
+    friend screen<T, caps> &operator<<(screen<T, caps> &o, const screen_command_move &cmd) {
+        o.setcursorxy(cmd.x, cmd.y);
+        return o;
+    }
+    template<char_type T, typename caps>
+    friend view<T, caps> &operator<<(view<T, caps> &o, const screen_command_move &cmd) {
         o.setcursorxy(cmd.x, cmd.y);
         return o;
     }
@@ -236,7 +2019,13 @@ struct screen_command_plot : public screen_command_base {
     chartype c;
     unsigned x, y;
     explicit screen_command_plot(unsigned X, unsigned Y, chartype C) : c(C), x(X), y(Y) {}
-    friend screen<chartype> &operator<<(screen<chartype> &o, const screen_command_plot &cmd) {
+    template<typename caps>
+    friend screen<chartype, caps> &operator<<(screen<chartype, caps> &o, const screen_command_plot &cmd) {
+        o.setc(cmd.x, cmd.y, cmd.c);
+        return o;
+    }
+    template<typename caps>
+    friend view<chartype, caps> &operator<<(view<chartype, caps> &o, const screen_command_plot &cmd) {
         o.setc(cmd.x, cmd.y, cmd.c);
         return o;
     }
@@ -250,8 +2039,14 @@ struct screen_command_recolor : public screen_command_base {
     explicit screen_command_recolor(color Fg, bool side) : fg(Fg), bg(Fg), rfg(side ? true : false), rbg(side ? false : true) {}
     explicit screen_command_recolor(color Fg, color Bg) : fg(Fg), bg(Bg), rfg(true), rbg(true) {}
 
-    template<char_type T>
-    friend screen<T> &operator<<(screen<T> &o, const screen_command_recolor &cmd) {
+    template<char_type T, typename caps>
+    friend screen<T, caps> &operator<<(screen<T, caps> &o, const screen_command_recolor &cmd) {
+        if(cmd.rbg) o.setcursorbg(cmd.bg);
+        if(cmd.rfg) o.setcursorfg(cmd.fg);
+        return o;
+    }
+    template<char_type T, typename caps>
+    friend view<T, caps> &operator<<(view<T, caps> &o, const screen_command_recolor &cmd) {
         if(cmd.rbg) o.setcursorbg(cmd.bg);
         if(cmd.rfg) o.setcursorfg(cmd.fg);
         return o;
@@ -262,6 +2057,871 @@ struct screen_command_recolor : public screen_command_base {
 [[nodiscard]] static screen_command_recolor setcolor(color fg, color bg) { return screen_command_recolor{fg, bg}; }
 
 
+
+/* Owns several screens drawn onto one terminal. Each terminal cell belongs to the
+ * topmost screen covering it; a flush merges the screens' changes into one frame. */
+template<char_type chartype, typename caps = dynamic_capabilities>
+class compositor {
+public:
+    explicit compositor(std::shared_ptr<sink> Sink, unsigned W, unsigned H) :
+        m_width(W), m_height(H), m_out(std::make_shared<writer>(std::move(Sink))), m_owner(W * H) {}
+    explicit compositor(unsigned W, unsigned H) :
+        compositor(std::make_shared<ostream_sink>(std::cout), W, H) {}
+
+    screen<chartype, caps> &add(unsigned X, unsigned Y, unsigned W, unsigned H, int Z, chartype C, color B, color F) {
+        auto s = std::make_unique<screen<chartype, caps>>(m_out, X, Y, W, H, C, B, F);
+        auto at = std::upper_bound(m_layers.begin(), m_layers.end(), Z,
+                [](int z, const layer &l) { return z < l.z; });
+        screen<chartype, caps> &ref = *s;
+        m_layers.insert(at, layer{std::move(s), Z});
+        m_relayout = true;
+        return ref;
+    }
+    screen<chartype, caps> &add(unsigned X, unsigned Y, unsigned W, unsigned H, int Z = 0) {
+        return add(X, Y, W, H, Z, ' ', color{0, 0, 0}, color{255, 255, 255});
+    }
+
+    void remove(const screen<chartype, caps> &s) {
+        if(m_focus == &s) m_focus = nullptr;
+        std::erase_if(m_layers, [&](const layer &l) { return l.scr.get() == &s; });
+        m_relayout = true;
+    }
+
+    /* The screen whose cursor the terminal cursor rests at between frames. */
+    void setfocus(const screen<chartype, caps> *s) { m_focus = s; }
+    void setframing(bool sync, bool hidecursor) { m_out->setframing(sync, hidecursor); }
+
+    /* What cells outside every layer show. */
+    void setfill(chartype c, color B, color F) {
+        m_fillChar = c;
+        m_fill = attribs{B, F};
+        m_relayout = true;
+    }
+
+    /* Ownership and hardware scrolling depend on every layer's size, so both of these
+     * repaint everything on the next flush. */
+    void resize(unsigned W, unsigned H) {
+        m_width = W; m_height = H;
+        m_owner.assign(std::size_t{W} * H, nullptr);
+        m_relayout = true;
+    }
+    void resize(screen<chartype, caps> &s, unsigned W, unsigned H) {
+        s.resize(W, H);
+        m_relayout = true;
+    }
+
+    void setz(const screen<chartype, caps> &s, int z) {
+        auto it = std::find_if(m_layers.begin(), m_layers.end(), [&](const layer &l) { return l.scr.get() == &s; });
+        if(it == m_layers.end()) return;
+        layer l = std::move(*it);
+        l.z = z;
+        m_layers.erase(it);
+        auto at = std::upper_bound(m_layers.begin(), m_layers.end(), z,
+                [](int z, const layer &o) { return z < o.z; });
+        m_layers.insert(at, std::move(l));
+        m_relayout = true;
+    }
+
+    void redraw() {
+        redraw(*m_out);
+        m_out->commit();
+    }
+
+    void flush() {
+        flush(*m_out);
+        m_out->commit();
+    }
+
+    void redraw(writer &out) {
+        relayout();
+        out.invalidate();
+        /* Cells no layer covers any more would keep whatever was last drawn there. */
+        for(unsigned y = 0; y < m_height; y++) {
+            for(unsigned x = 0; x < m_width; x++) {
+                if(m_owner[x + y * m_width]) continue;
+                out.move(x, y);
+                out.template attr<caps>(m_fill);
+                out.template glyph<caps>(m_fillChar);
+                if(x + 1 >= m_width) out.pendingwrap();
+            }
+        }
+        for(layer &l : m_layers) l.scr->redraw(out, visibility(*l.scr));
+        if(m_focus) m_focus->parkcursor(out);
+    }
+
+    void flush(writer &out) {
+        if(m_relayout) {
+            redraw(out);
+            return;
+        }
+        for(layer &l : m_layers) l.scr->flush(out, visibility(*l.scr));
+        if(m_focus) m_focus->parkcursor(out);
+    }
+
+    void setcolordepth(color_depth depth) {
+        m_out->setcolordepth(depth);
+        m_relayout = true;
+    }
+
+    constexpr unsigned getwidth() { return m_width; }
+    constexpr unsigned getheight() { return m_height; }
+
+    bool dirty() const {
+        return m_relayout || std::any_of(m_layers.begin(), m_layers.end(), [](const layer &l) { return l.scr->dirty(); });
+    }
+private:
+    struct layer {
+        std::unique_ptr<screen<chartype, caps>> scr;
+        int z;
+    };
+
+    auto visibility(screen<chartype, caps> &s) {
+        return [this, &s, x0 = s.getx(), y0 = s.gety()](unsigned x, unsigned y) {
+            unsigned tx = x0 + x, ty = y0 + y;
+            return tx < m_width && ty < m_height && m_owner[tx + ty * m_width] == &s;
+        };
+    }
+
+    /* Higher layers claim cells last. Hardware scrolling moves whole terminal lines,
+     * so only a screen spanning the full width and owning all of its cells may use it. */
+    void relayout() {
+        std::fill(m_owner.begin(), m_owner.end(), nullptr);
+        for(layer &l : m_layers) {
+            screen<chartype, caps> &s = *l.scr;
+            for(unsigned y = s.gety(); y < std::min(s.gety() + s.getheight(), m_height); y++)
+                for(unsigned x = s.getx(); x < std::min(s.getx() + s.getwidth(), m_width); x++)
+                    m_owner[x + y * m_width] = &s;
+        }
+        for(layer &l : m_layers) {
+            screen<chartype, caps> &s = *l.scr;
+            bool whole = s.getx() == 0 && s.getwidth() == m_width && s.gety() + s.getheight() <= m_height;
+            for(unsigned i = s.gety() * m_width; whole && i < (s.gety() + s.getheight()) * m_width; i++)
+                whole = m_owner[i] == &s;
+            s.sethardwarescroll(whole);
+        }
+        m_relayout = false;
+    }
+
+    unsigned m_width{}, m_height{};
+    std::shared_ptr<writer> m_out;
+    std::vector<layer> m_layers;
+    std::vector<const screen<chartype, caps>*> m_owner;
+    const screen<chartype, caps> *m_focus{};
+    chartype m_fillChar{' '};
+    attribs m_fill{};
+    bool m_relayout{true};
+};
+
+
+/* Encodes and writes frames of a screen or compositor on its own thread. flush() only
+ * requests a frame: requests arriving while a frame is being written, or within one frame
+ * period of the last one, are coalesced into a single frame. Producers must hold lock()
+ * while they modify the target; the lock is only held while a frame is encoded, never
+ * while it is written. */
+template<typename target>
+class renderer {
+public:
+    using clock = std::chrono::steady_clock;
+
+    explicit renderer(target &T, std::shared_ptr<sink> Sink, unsigned Fps = 60) :
+        m_target(T), m_sink(std::move(Sink)), m_period(std::chrono::nanoseconds(1'000'000'000 / std::max(Fps, 1u))),
+        m_thread([this] { run(); }) {}
+
+    renderer(const renderer &) = delete;
+    renderer &operator=(const renderer &) = delete;
+
+    /* Writes out any requested frame before stopping. */
+    ~renderer() {
+        {
+            std::lock_guard l(m_requestMutex);
+            m_stop = true;
+        }
+        m_wake.notify_one();
+        m_thread.join();
+    }
+
+    [[nodiscard]] std::unique_lock<std::mutex> lock() { return std::unique_lock(m_targetMutex); }
+
+    void flush() {
+        {
+            std::lock_guard l(m_requestMutex);
+            m_requested = true;
+        }
+        m_wake.notify_one();
+    }
+    void redraw() {
+        {
+            std::lock_guard l(m_requestMutex);
+            m_requested = m_full = true;
+        }
+        m_wake.notify_one();
+    }
+
+    void setframerate(unsigned fps) {
+        std::lock_guard l(m_requestMutex);
+        m_period = std::chrono::nanoseconds(1'000'000'000 / std::max(fps, 1u));
+    }
+
+    void setframing(bool sync, bool hidecursor) {
+        std::lock_guard l(m_targetMutex);
+        m_out.setframing(sync, hidecursor);
+    }
+
+private:
+    void run() {
+        clock::time_point next = clock::now();
+        std::string frame;
+        std::unique_lock l(m_requestMutex);
+        while(true) {
+            m_wake.wait(l, [this] { return m_requested || m_stop; });
+            if(!m_requested) break;
+            if(!m_stop) m_wake.wait_until(l, next, [this] { return m_stop; });
+            bool full = m_full;
+            m_requested = m_full = false;
+            l.unlock();
+            {
+                std::lock_guard t(m_targetMutex);
+                if(full) m_target.redraw(m_out);
+                else m_target.flush(m_out);
+                m_out.take(frame);
+            }
+            if(!frame.empty()) m_sink->write(frame);
+            l.lock();
+            next = clock::now() + m_period;
+        }
+    }
+
+    target &m_target;
+    std::shared_ptr<sink> m_sink;
+    writer m_out;
+    clock::duration m_period;
+
+    std::mutex m_targetMutex;
+    std::mutex m_requestMutex;
+    std::condition_variable m_wake;
+    bool m_requested{true}, m_full{true}, m_stop{};
+
+    std::thread m_thread;
+};
+
+/* A key press, mouse report or change of terminal size. Keys carry a code point, or one of
+ * the named keys past the end of Unicode; control characters arrive as they are, so Enter
+ * is '\r', Backspace 0x7f and Ctrl-C 0x03. Mouse cells are zero-based; a resize carries the
+ * new columns and rows in x and y. */
+struct input_event {
+    enum class kind : std::uint8_t { key, mouse, resize };
+    enum modifier : std::uint8_t { shift = 1, alt = 2, ctrl = 4 };
+    enum named : char32_t {
+        up = 0x110000, down, right, left, home, end, insert, del, pageup, pagedown,
+        f1, f2, f3, f4, f5, f6, f7, f8, f9, f10, f11, f12
+    };
+    enum button : std::uint8_t { mouseleft, mousemiddle, mouseright, mousenone, wheelup, wheeldown };
+
+    kind type{kind::key};
+    std::uint8_t mods{};
+    std::uint8_t button{};
+    bool release{}, motion{};
+    char32_t key{};
+    unsigned x{}, y{};
+};
+
+/* Turns bytes read from a terminal into input_events as they arrive. A sequence split
+ * across reads is held in a small fixed buffer until the rest comes in, so nothing is
+ * allocated. A lone ESC cannot be told from the start of a sequence until no more bytes
+ * follow it; expire() then reports whatever is held as plain keys. Understands UTF-8,
+ * Alt as an ESC prefix, CSI and SS3 keys with xterm modifiers and SGR mouse reports;
+ * other sequences are dropped. */
+class input_parser {
+public:
+    template<typename Handler>
+    void feed(std::string_view bytes, Handler &&handler) {
+        for(char ch : bytes) {
+            /* Nothing this long is a sequence we know, so the rest of it is skipped up to
+             * its final byte rather than read as keys. */
+            if(m_len == m_buf.size()) {
+                m_len = 0;
+                m_skipping = true;
+            }
+            if(m_skipping) {
+                m_skipping = ch < 0x40 || ch > 0x7e;
+                continue;
+            }
+            m_buf[m_len++] = ch;
+            parse(handler);
+        }
+    }
+
+    template<typename Handler>
+    void expire(Handler &&handler) {
+        m_skipping = false;
+        if(m_len == 0) return;
+        std::array<char, 32> held = m_buf;
+        std::size_t n = m_len;
+        m_len = 0;
+        /* A partial UTF-8 glyph is replaced, as in feed(). */
+        if(held[0] != '\x1b') {
+            handler(keyevent(0xfffd, 0));
+            return;
+        }
+        handler(keyevent(0x1b, 0));
+        feed({held.data() + 1, n - 1}, handler);
+    }
+
+    bool pending() const { return m_len > 0 || m_skipping; }
+private:
+    static input_event keyevent(char32_t key, std::uint8_t mods) {
+        input_event ev;
+        ev.key = key;
+        ev.mods = mods;
+        return ev;
+    }
+
+    /* xterm sends 1 + the modifier bits as the second parameter. */
+    static std::uint8_t xtermmods(unsigned p) { return p > 1 ? (p - 1) & 7 : 0; }
+
+    unsigned char byte(std::size_t i) const { return static_cast<unsigned char>(m_buf[i]); }
+
+    template<typename Handler>
+    void done(Handler &handler, const input_event &ev) {
+        m_len = 0;
+        handler(ev);
+    }
+
+    /* Drops the held bytes before from and parses what is left. */
+    template<typename Handler>
+    void reparse(Handler &handler, std::size_t from) {
+        std::copy(m_buf.begin() + from, m_buf.begin() + m_len, m_buf.begin());
+        m_len -= from;
+        if(m_len > 0) parse(handler);
+    }
+
+    template<typename Handler>
+    void parse(Handler &handler) {
+        if(byte(0) != 0x1b) {
+            unsigned char lead = byte(0);
+            std::size_t need = lead < 0xc0 || lead >= 0xf8 ? 1 : lead >= 0xf0 ? 4 : lead >= 0xe0 ? 3 : 2;
+            /* A glyph cut short is replaced, and the byte that cut it starts over. */
+            if(m_len > 1 && (byte(m_len - 1) & 0xc0) != 0x80) {
+                handler(keyevent(0xfffd, 0));
+                reparse(handler, m_len - 1);
+                return;
+            }
+            if(m_len < need) return;
+            char32_t c = need == 1 ? (lead < 0x80 ? lead : 0xfffd) : lead & (0x7f >> need);
+            for(std::size_t i = 1; i < need; i++) c = c << 6 | (byte(i) & 0x3f);
+            done(handler, keyevent(c, 0));
+            return;
+        }
+        if(m_len == 1) return;
+        if(byte(1) == '[') {
+            csi(handler);
+        } else if(byte(1) == 'O') {
+            if(m_len == 3) ss3(handler);
+        } else if(byte(1) == 0x1b) {
+            /* The second ESC may start a sequence of its own. */
+            m_len = 1;
+            handler(keyevent(0x1b, 0));
+        } else if(byte(1) < 0x80) {
+            done(handler, keyevent(byte(1), input_event::alt));
+        } else {
+            handler(keyevent(0x1b, 0));
+            reparse(handler, 1);
+        }
+    }
+
+    template<typename Handler>
+    void csi(Handler &handler) {
+        unsigned char final = byte(m_len - 1);
+        if(m_len == 2 || final < 0x40 || final > 0x7e) return;
+        bool sgrmouse = byte(2) == '<';
+        std::array<unsigned, 4> p{};
+        std::size_t np = 0;
+        for(std::size_t i = sgrmouse ? 3 : 2; i + 1 < m_len; i++) {
+            if(byte(i) == ';') np = std::min(np + 1, p.size() - 1);
+            else if(byte(i) >= '0' && byte(i) <= '9') p[np] = std::min(p[np] * 10 + (byte(i) - '0'), 0xffffu);
+        }
+        if(sgrmouse) {
+            if(final != 'M' && final != 'm') { m_len = 0; return; }
+            unsigned cb = p[0];
+            input_event ev;
+            ev.type = input_event::kind::mouse;
+            ev.button = cb & 64 ? input_event::wheelup + (cb & 1) : cb & 3;
+            ev.mods = (cb & 4 ? input_event::shift : 0) | (cb & 8 ? input_event::alt : 0) | (cb & 16 ? input_event::ctrl : 0);
+            ev.motion = cb & 32;
+            ev.release = final == 'm';
+            ev.x = p[1] > 0 ? p[1] - 1 : 0;
+            ev.y = p[2] > 0 ? p[2] - 1 : 0;
+            done(handler, ev);
+            return;
+        }
+        char32_t key = 0;
+        if(final >= 'A' && final <= 'D') key = input_event::up + (final - 'A');
+        else if(final == 'H') key = input_event::home;
+        else if(final == 'F') key = input_event::end;
+        else if(final == 'Z') { done(handler, keyevent('\t', input_event::shift)); return; }
+        else if(final == '~') key = tildekey(p[0]);
+        if(key == 0) { m_len = 0; return; }
+        done(handler, keyevent(key, xtermmods(p[1])));
+    }
+
+    template<typename Handler>
+    void ss3(Handler &handler) {
+        unsigned char c = byte(2);
+        char32_t key = 0;
+        if(c >= 'A' && c <= 'D') key = input_event::up + (c - 'A');
+        else if(c == 'H') key = input_event::home;
+        else if(c == 'F') key = input_event::end;
+        else if(c >= 'P' && c <= 'S') key = input_event::f1 + (c - 'P');
+        if(key != 0) {
+            done(handler, keyevent(key, 0));
+            return;
+        }
+        /* Not SS3 after all, but Alt-O and whatever came next. */
+        handler(keyevent('O', input_event::alt));
+        reparse(handler, 2);
+    }
+
+    static char32_t tildekey(unsigned n) {
+        switch(n) {
+        case 1: case 7: return input_event::home;
+        case 2: return input_event::insert;
+        case 3: return input_event::del;
+        case 4: case 8: return input_event::end;
+        case 5: return input_event::pageup;
+        case 6: return input_event::pagedown;
+        }
+        if(n >= 11 && n <= 15) return input_event::f1 + (n - 11);
+        if(n >= 17 && n <= 21) return input_event::f6 + (n - 17);
+        if(n == 23 || n == 24) return input_event::f11 + (n - 23);
+        return 0;
+    }
+
+    std::array<char, 32> m_buf{};
+    std::size_t m_len{};
+    bool m_skipping{};
+};
+
+#if defined(STRAW_POSIX) && defined(STRAW_TTY)
+/* Puts a terminal into raw mode for as long as it lives: bytes arrive unbuffered and
+ * unechoed, and Ctrl-C, Ctrl-Z and Ctrl-S reach the application as keys. Output processing
+ * is left alone. With Mouse, presses, releases, drags and the wheel are reported as SGR
+ * mouse sequences. Everything is put back on destruction. */
+class tty_mode {
+public:
+    explicit tty_mode(int In = STDIN_FILENO, int Out = STDOUT_FILENO, bool Mouse = false) : m_in(In), m_out(Out) {
+        if(::tcgetattr(m_in, &m_saved) != 0) return;
+        termios raw = m_saved;
+        raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+        raw.c_cflag |= CS8;
+        raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+        raw.c_cc[VMIN] = 1;
+        raw.c_cc[VTIME] = 0;
+        m_raw = ::tcsetattr(m_in, TCSAFLUSH, &raw) == 0;
+        if(m_raw && Mouse) m_mouse = send(ansi_fixed::mouseon);
+    }
+
+    tty_mode(const tty_mode &) = delete;
+    tty_mode &operator=(const tty_mode &) = delete;
+
+    ~tty_mode() {
+        if(m_mouse) send(ansi_fixed::mouseoff);
+        if(m_raw) ::tcsetattr(m_in, TCSAFLUSH, &m_saved);
+    }
+
+    bool active() const { return m_raw; }
+private:
+    bool send(ansi_fixed f) {
+        fd_sink out(m_out);
+        out.write(ANSI_FIXED_SEQ(f));
+        return out.error() == 0;
+    }
+
+    int m_in, m_out;
+    termios m_saved{};
+    bool m_raw{}, m_mouse{};
+};
+
+/* Drives a screen or compositor from its input on the calling thread. Sleeps in poll(2)
+ * until input or SIGWINCH arrives or the next frame is due, hands events to a handler, and
+ * flushes the target at most once per frame period and only while it is dirty, so an idle
+ * target costs no wakeups at all. The handler may edit the target and call stop(); it is
+ * also the one to resize anything on a resize event. SIGWINCH is process-wide, so only one
+ * loop should run at a time. */
+template<typename target>
+class event_loop {
+public:
+    using clock = std::chrono::steady_clock;
+    static constexpr std::chrono::milliseconds escapedelay{25};
+
+    explicit event_loop(target &T, int In = STDIN_FILENO, unsigned Fps = 60) :
+        m_target(T), m_in(In), m_period(std::chrono::nanoseconds(1'000'000'000 / std::max(Fps, 1u))) {
+        if(::pipe(m_wake) != 0) { m_wake[0] = m_wake[1] = -1; return; }
+        for(int fd : m_wake) {
+            ::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) | O_NONBLOCK);
+            ::fcntl(fd, F_SETFD, FD_CLOEXEC);
+        }
+    }
+
+    event_loop(const event_loop &) = delete;
+    event_loop &operator=(const event_loop &) = delete;
+
+    ~event_loop() {
+        for(int fd : m_wake) if(fd >= 0) ::close(fd);
+    }
+
+    /* Returns once stop() is called or the input ends, after flushing anything left dirty. */
+    template<typename Handler>
+    void run(Handler &&handler) {
+        struct sigaction act{}, old{};
+        winchfd().store(m_wake[1]);
+        act.sa_handler = onwinch;
+        sigemptyset(&act.sa_mask);
+        act.sa_flags = SA_RESTART;
+        ::sigaction(SIGWINCH, &act, &old);
+
+        std::array<char, 256> buf;
+        clock::time_point next = clock::now(), expiry{};
+        while(!m_stop.load()) {
+            clock::time_point now = clock::now();
+            int timeout = -1;
+            auto until = [&](clock::time_point t) {
+                int ms = t <= now ? 0 : static_cast<int>(std::chrono::ceil<std::chrono::milliseconds>(t - now).count());
+                timeout = timeout < 0 ? ms : std::min(timeout, ms);
+            };
+            if(m_parser.pending()) until(expiry);
+            if(m_target.dirty()) until(next);
+
+            pollfd fds[2] = {{m_in, POLLIN, 0}, {m_wake[0], POLLIN, 0}};
+            if(::poll(fds, 2, timeout) < 0 && errno != EINTR) break;
+            now = clock::now();
+
+            if(fds[1].revents & POLLIN) {
+                bool resized = false;
+                char c;
+                while(::read(m_wake[0], &c, 1) == 1) resized |= c == 'w';
+                winsize ws{};
+                if(resized && (::ioctl(m_in, TIOCGWINSZ, &ws) == 0 || ::ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0)) {
+                    input_event ev;
+                    ev.type = input_event::kind::resize;
+                    ev.x = ws.ws_col;
+                    ev.y = ws.ws_row;
+                    handler(ev);
+                }
+            }
+            if(fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+                ssize_t n = ::read(m_in, buf.data(), buf.size());
+                if(n > 0) {
+                    m_parser.feed({buf.data(), static_cast<std::size_t>(n)}, handler);
+                    expiry = now + escapedelay;
+                } else if(n == 0 || (errno != EINTR && errno != EAGAIN)) {
+                    m_parser.expire(handler);
+                    break;
+                }
+            } else if(m_parser.pending() && now >= expiry) {
+                m_parser.expire(handler);
+            }
+
+            if(m_target.dirty() && clock::now() >= next) {
+                m_target.flush();
+                next = clock::now() + m_period;
+            }
+        }
+        if(m_target.dirty()) m_target.flush();
+
+        ::sigaction(SIGWINCH, &old, nullptr);
+        winchfd().store(-1);
+        m_stop = false;
+    }
+
+    /* Safe from any thread and from the handler. */
+    void stop() {
+        m_stop = true;
+        char c = 's';
+        if(m_wake[1] >= 0) (void)!::write(m_wake[1], &c, 1);
+    }
+
+    void setframerate(unsigned fps) { m_period = std::chrono::nanoseconds(1'000'000'000 / std::max(fps, 1u)); }
+private:
+    static std::atomic<int> &winchfd() {
+        static std::atomic<int> fd{-1};
+        return fd;
+    }
+
+    static void onwinch(int) {
+        int fd = winchfd().load();
+        if(fd < 0) return;
+        int saved = errno;
+        char c = 'w';
+        (void)!::write(fd, &c, 1);
+        errno = saved;
+    }
+
+    target &m_target;
+    int m_in;
+    clock::duration m_period;
+    int m_wake[2];
+    input_parser m_parser;
+    std::atomic<bool> m_stop{};
+};
+#endif
+
+/* A virtual terminal fed with what a writer sends: CUP, CUF, CR, LF, SGR, DECSTBM and SU,
+ * UTF-8 text with the deferred wrap at the right margin and two-cell wide glyphs. Every
+ * write is taken as one frame and its bytes, escapes and glyphs are counted, so the cost
+ * of each frame and the grid it leaves behind can be checked against the screen. Byte-sized
+ * screens are decoded as UTF-8 too and should stick to ASCII. */
+class terminal : public sink {
+public:
+    /* Colors as last set by SGR: 0 for the default, or tagged RGB or palette index. */
+    static constexpr std::uint32_t rgbcolor = 1u << 24, palettecolor = 2u << 24;
+    static constexpr char32_t widetail = ~char32_t{0};
+
+    struct glyph {
+        char32_t chr;
+        std::uint32_t fg{}, bg{};
+        bool bold{}, underline{};
+    };
+    struct frame {
+        std::size_t bytes{}, escapes{}, glyphs{};
+    };
+
+    terminal(unsigned W, unsigned H, char32_t Blank = ' ') :
+        m_width(W), m_height(H), m_blank(Blank), m_bottom(H), m_grid(W * H, glyph{Blank}) {}
+
+    void write(std::string_view data) override {
+        m_frames.push_back(frame{data.size()});
+        m_pending.append(data);
+        std::string_view s = m_pending;
+        std::size_t i = 0;
+        while(i < s.size()) {
+            std::size_t n = s[i] == '\x1b' ? escape(s.substr(i)) : text(s.substr(i));
+            if(n == 0) break;
+            i += n;
+        }
+        m_pending.erase(0, i);
+    }
+
+    const glyph &at(unsigned x, unsigned y) const { return m_grid[y * m_width + x]; }
+    const std::vector<frame> &history() const { return m_frames; }
+    unsigned cursorx() const { return m_cx; }
+    unsigned cursory() const { return m_cy; }
+
+    /* How a color of depth looks once it has been through SGR. */
+    static std::uint32_t encode(color c, color_depth depth) {
+        if(depth == color_depth::mono) return 0;
+        if(depth == color_depth::truecolor) return rgbcolor | c.r << 16 | c.g << 8 | c.b;
+        return palettecolor | QUANTIZE(c, depth);
+    }
+
+    /* Whether the cells of s, at its place on the terminal, show what it displays: its live
+     * rows, or its history while scrolled back. */
+    template<char_type chartype, typename caps>
+    bool shows(const screen<chartype, caps> &s, unsigned X, unsigned Y, unsigned W, unsigned H) const {
+        color_depth depth = s.getcolordepth();
+        std::vector<cell<chartype>> shown(W);
+        for(unsigned y = 0; y < H; y++) {
+            s.displayrow(y, shown);
+            for(unsigned x = 0; x < W; x++) {
+                if(X + x >= m_width || Y + y >= m_height) return false;
+                const cell<chartype> &want = shown[x];
+                const glyph &have = at(X + x, Y + y);
+                const attribs &a = s.getattribs(want.style);
+                constexpr chartype tailchr = std::numeric_limits<chartype>::max();
+                bool tail = want.chr == tailchr && sizeof(chartype) > 1;
+                chartype c = want.chr;
+                /* A half without its other half is drawn as the fill character. */
+                if(tail ? x == 0 || glyphwidth(shown[x - 1].chr) != 2 : glyphwidth(c) == 2 && (x + 1 >= W || shown[x + 1].chr != tailchr)) {
+                    tail = false;
+                    c = s.getfillchar();
+                }
+                char32_t chr = sizeof(chartype) == 1 ? static_cast<unsigned char>(c) : codepoint(c);
+                if(tail ? have.chr != widetail : have.chr != chr) return false;
+                if(tail) continue;
+                if(have.fg != encode(a.fg, depth) || have.bg != encode(a.bg, depth)) return false;
+                if(have.bold != a.bold || have.underline != a.underline) return false;
+            }
+        }
+        return true;
+    }
+    template<char_type chartype, typename caps>
+    bool shows(screen<chartype, caps> &s) const { return shows(s, s.getx(), s.gety(), s.getwidth(), s.getheight()); }
+
+private:
+    /* Length of the sequence at the front of s, or 0 if it is cut off. */
+    std::size_t escape(std::string_view s) {
+        if(s.size() < 2) return 0;
+        if(s[1] != '[') { m_frames.back().escapes++; return 2; }
+        std::size_t end = 2;
+        while(end < s.size() && (s[end] < 0x40 || s[end] > 0x7e)) end++;
+        if(end == s.size()) return 0;
+        m_frames.back().escapes++;
+        std::array<unsigned, 16> p{};
+        unsigned np = 0;
+        bool priv = s[2] == '?';
+        for(std::size_t j = priv ? 3 : 2; j < end && np < p.size(); j++) {
+            if(s[j] == ';') np++;
+            else if(s[j] >= '0' && s[j] <= '9') p[np] = p[np] * 10 + (s[j] - '0');
+        }
+        np = end > 2 ? np + 1 : 0;
+        if(priv) return end + 1;
+        auto arg = [&](unsigned k, unsigned def) { return k < np && p[k] ? p[k] : def; };
+        switch(s[end]) {
+            case 'H':
+                m_cy = std::min(arg(0, 1), m_height) - 1; m_cx = std::min(arg(1, 1), m_width) - 1; m_wrap = false;
+                break;
+            case 'C':
+                m_cx = std::min(m_cx + arg(0, 1), m_width - 1); m_wrap = false;
+                break;
+            case 'r':
+                m_top = arg(0, 1) - 1; m_bottom = std::min(arg(1, m_height), m_height);
+                if(m_top >= m_bottom) { m_top = 0; m_bottom = m_height; }
+                m_cx = m_cy = 0; m_wrap = false;
+                break;
+            case 'S':
+                for(unsigned n = arg(0, 1); n > 0; n--) scrollregion();
+                break;
+            case 'm':
+                sgr(p, np);
+                break;
+        }
+        return end + 1;
+    }
+
+    void sgr(const std::array<unsigned, 16> &p, unsigned np) {
+        if(np == 0) { m_pen = glyph{m_blank}; return; }
+        for(unsigned k = 0; k < np; k++) {
+            unsigned v = p[k];
+            if(v == 0) m_pen = glyph{m_blank};
+            else if(v == 1) m_pen.bold = true;
+            else if(v == 22) m_pen.bold = false;
+            else if(v == 4) m_pen.underline = true;
+            else if(v == 24) m_pen.underline = false;
+            else if(v == 39) m_pen.fg = 0;
+            else if(v == 49) m_pen.bg = 0;
+            else if((v >= 30 && v <= 37) || (v >= 90 && v <= 97)) m_pen.fg = palettecolor | (v < 90 ? v - 30 : v - 82);
+            else if((v >= 40 && v <= 47) || (v >= 100 && v <= 107)) m_pen.bg = palettecolor | (v < 100 ? v - 40 : v - 92);
+            else if((v == 38 || v == 48) && k + 1 < np) {
+                std::uint32_t &c = v == 38 ? m_pen.fg : m_pen.bg;
+                if(p[k + 1] == 5 && k + 2 < np) { c = palettecolor | (p[k + 2] & 0xff); k += 2; }
+                else if(p[k + 1] == 2 && k + 4 < np) { c = rgbcolor | (p[k + 2] & 0xff) << 16 | (p[k + 3] & 0xff) << 8 | (p[k + 4] & 0xff); k += 4; }
+            }
+        }
+    }
+
+    /* Length of the control or UTF-8 character at the front of s, or 0 if it is cut off.
+     * A malformed sequence is taken one byte at a time, as that byte's own code point. */
+    std::size_t text(std::string_view s) {
+        unsigned char b = s[0];
+        if(b == '\r') { m_cx = 0; m_wrap = false; return 1; }
+        if(b == '\n') { linefeed(); return 1; }
+        if(b < 0x20) return 1;
+        std::size_t n = b < 0x80 ? 1 : (b & 0xe0) == 0xc0 ? 2 : (b & 0xf0) == 0xe0 ? 3 : (b & 0xf8) == 0xf0 ? 4 : 1;
+        if(s.size() < n) return 0;
+        char32_t u = n == 1 ? b : b & (0x7f >> n);
+        for(std::size_t j = 1; j < n; j++) {
+            if((s[j] & 0xc0) != 0x80) { n = 1; u = b; break; }
+            u = u << 6 | (s[j] & 0x3f);
+        }
+        put(u);
+        return n;
+    }
+
+    void put(char32_t u) {
+        m_frames.back().glyphs++;
+        unsigned w = glyphwidth(u);
+        if(m_wrap || (w == 2 && m_cx + 1 >= m_width)) {
+            m_cx = 0; m_wrap = false;
+            linefeed();
+        }
+        glyph *r = &m_grid[m_cy * m_width];
+        /* Overwriting half of a wide glyph blanks the other half. */
+        if(r[m_cx].chr == widetail && m_cx > 0) r[m_cx - 1].chr = m_blank;
+        if(m_cx + w < m_width && r[m_cx + w].chr == widetail) r[m_cx + w].chr = m_blank;
+        r[m_cx] = m_pen; r[m_cx].chr = u;
+        if(w == 2) { r[m_cx + 1] = m_pen; r[m_cx + 1].chr = widetail; }
+        if(m_cx + w >= m_width) { m_cx = m_width - 1; m_wrap = true; }
+        else m_cx += w;
+    }
+
+    void linefeed() {
+        m_wrap = false;
+        if(m_cy + 1 == m_bottom) scrollregion();
+        else if(m_cy + 1 < m_height) m_cy++;
+    }
+
+    void scrollregion() {
+        auto first = m_grid.begin() + m_top * m_width, last = m_grid.begin() + m_bottom * m_width;
+        std::copy(first + m_width, last, first);
+        glyph blank = m_pen; blank.chr = m_blank; blank.bold = blank.underline = false;
+        std::fill(last - m_width, last, blank);
+    }
+
+    unsigned m_width, m_height;
+    char32_t m_blank;
+    unsigned m_cx{}, m_cy{}, m_top{}, m_bottom;
+    bool m_wrap{};
+    glyph m_pen{m_blank};
+    std::vector<glyph> m_grid;
+    std::vector<frame> m_frames;
+    std::string m_pending;
+};
+
+/* A fixed list of operations on a screen that can be replayed, so the bytes a sequence of
+ * edits costs and the picture it leaves can be compared across versions of flush(). */
+template<char_type chartype>
+class recording {
+public:
+    struct result {
+        terminal::frame sent;
+        bool matches;
+    };
+
+    void setcursorxy(unsigned x, unsigned y) { m_ops.push_back(op{op::move, x, y}); }
+    void setcolor(color fg, color bg) { m_ops.push_back(op{op::recolor, 0, 0, {}, fg, bg}); }
+    void setc(unsigned x, unsigned y, chartype c) { m_ops.push_back(op{op::setc, x, y, c}); }
+    void puts(std::basic_string_view<chartype> s) { m_ops.push_back(op{op::puts, 0, 0, {}, 0, 0, std::basic_string<chartype>(s)}); }
+    void clear(chartype c) { m_ops.push_back(op{op::clear, 0, 0, c}); }
+    void scroll() { m_ops.push_back(op{op::scroll}); }
+    void flush() { m_ops.push_back(op{op::flush}); }
+
+    /* Apply every operation to s, whose sink is t, and after each flush record what was
+     * sent and whether t then shows s's front buffer. */
+    template<typename caps>
+    std::vector<result> replay(screen<chartype, caps> &s, const terminal &t) const {
+        std::vector<result> out;
+        for(const op &o : m_ops) {
+            switch(o.kind) {
+                case op::move: s.setcursorxy(o.x, o.y); break;
+                case op::recolor: s.setcursorfg(o.fg); s.setcursorbg(o.bg); break;
+                case op::setc: s.setc(o.x, o.y, o.c); break;
+                case op::puts: s.puts(o.text); break;
+                case op::clear: s.clear(o.c); break;
+                case op::scroll: s.scroll(); break;
+                case op::flush: {
+                    std::size_t before = t.history().size();
+                    s.flush();
+                    terminal::frame sent = t.history().size() > before ? t.history().back() : terminal::frame{};
+                    out.push_back(result{sent, t.shows(s)});
+                    break;
+                }
+            }
+        }
+        return out;
+    }
+
+    std::size_t size() const { return m_ops.size(); }
+
+private:
+    struct op {
+        enum { move, recolor, setc, puts, clear, scroll, flush } kind;
+        unsigned x{}, y{};
+        chartype c{};
+        color fg{0}, bg{0};
+        std::basic_string<chartype> text{};
+    };
+    std::vector<op> m_ops;
+};
+
 };
 
 #endif